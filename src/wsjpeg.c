@@ -12,15 +12,109 @@
  * later version.
  */
 
+#if defined(USE_MMAP) || defined(USE_STATS)
+#define _POSIX_C_SOURCE 200112L
+#endif
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <limits.h>
+#include <setjmp.h>
+#include "wsjpeg.h"
+#ifdef USE_PTHREAD
+#include <pthread.h>
+#endif
+#ifdef USE_STATS
+#include <time.h>
+#endif
+#ifdef USE_MMAP
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+/*
+ * SIMD kernels are only built on request, and only for single
+ * precision, so that the default build stays plain C89. GCC and
+ * Clang build the kernels of every x86 level into one binary and
+ * each encoder picks the widest the processor runs; other
+ * compilers build the ones their target options allow.
+ */
+#if defined(USE_SIMD) && !defined(USE_DOUBLE)
+#if (defined(__x86_64__) || defined(__i386__)) && \
+    (defined(__clang__) || __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define SIMD_SSE2
+#define SIMD_AVX2
+#define SIMD_DETECT
+#define SIMD_TARGET(isa)        __attribute__((target(isa)))
+#include <immintrin.h>
+#else
+#define SIMD_TARGET(isa)
+#if defined(__AVX2__)
+#define SIMD_AVX2
+#include <immintrin.h>
+#endif
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define SIMD_SSE2
+#include <emmintrin.h>
+#endif
+#endif
+#endif
 
 #define OUT_OF_MEMORY_ERROR     "Out of Memory!"
 #define BMP_OPEN_ERROR          "Can not open BMP file!"
 #define BMP_INVALID_ERROR       "Not a valid BMP file!"
 #define BMP_CORRUPT_ERROR       "Corrupt BMP File!"
 #define BMP_NOT_24BIT_ERROR     "Only supports 24-bit Bitmap!"
+#define JPG_OPEN_ERROR          "Can not open JPG file!"
+#define JPG_WRITE_ERROR         "Can not write JPG file!"
+#define THREAD_ERROR            "Can not create thread!"
+#define UNSUPPORTED_ERROR       "Not supported by this build or processor!"
+#define ARGUMENT_ERROR          "Invalid argument!"
+#define TOO_LARGE_ERROR         "Image is too large for JPEG!"
+#define LIST_OPEN_ERROR         "Can not open the list of images!"
+#define LIST_LINE_ERROR         "Expected INPUT OUTPUT [quality]!"
+#define LIST_LONG_ERROR         "Line is too long!"
+
+#define DCT_FLOAT               WSJPEG_DCT_FLOAT
+#define DCT_INTEGER             WSJPEG_DCT_INTEGER
+#define COLOR_FLOAT             WSJPEG_COLOR_FLOAT
+#define COLOR_INTEGER           WSJPEG_COLOR_INTEGER
+#define SAMPLING_COUNT          4   /* WSJPEG_SAMPLING_420 - WSJPEG_SAMPLING_GRAY */
+#define SIMD_COUNT              4   /* WSJPEG_SIMD_AUTO - WSJPEG_SIMD_AVX2 */
+#define MCU_GROUP_BLOCKS        24  /* blocks transformed at once, a multiple of the blocks per MCU and of the DCT lanes */
+#define JPEG_HEADER_SIZE        247 /* SOI, SOF0, DQT, DRI, SOS and DHT without its symbols */
+#define JPEG_SYMBOLS_MAX        348 /* Huffman symbols of baseline tables, 12 per DC and 162 per AC table */
+#define PASS_ENCODE             0   /* quantize and code in one go */
+#define PASS_GATHER             1   /* quantize, count the symbols and keep the coefficients */
+#define PASS_REPLAY             2   /* code the kept coefficients */
+#define PASS_CACHE              3   /* transform only and keep the blocks unquantized */
+#define BLOCK_DCT               0   /* transformed and quantized */
+#define BLOCK_FLAT              1   /* DC only, see dct_flat */
+#define BLOCK_REPEAT            2   /* the same pixels as the block one MCU before */
+#define COLOR_BITS              16  /* fraction bits of the color tables */
+#define R_Y_OFF                 (0 * 256)
+#define G_Y_OFF                 (1 * 256)
+#define B_Y_OFF                 (2 * 256)
+#define R_CB_OFF                (3 * 256)
+#define G_CB_OFF                (4 * 256)
+#define B_CB_OFF                (5 * 256)
+#define R_CR_OFF                B_CB_OFF    /* the same table, both are 0.5 */
+#define G_CR_OFF                (6 * 256)
+#define B_CR_OFF                (7 * 256)
+#define COLOR_TABLE_SIZE        (8 * 256)
+#define PIPE_EMPTY              ((UINT32) -1)
+#ifdef USE_INTEGER_DCT
+#define DCT_DEFAULT             DCT_INTEGER
+#else
+#define DCT_DEFAULT             DCT_FLOAT
+#endif
+#ifdef USE_INTEGER_COLOR
+#define COLOR_DEFAULT           COLOR_INTEGER
+#else
+#define COLOR_DEFAULT           COLOR_FLOAT
+#endif
 
 #ifdef USE_DOUBLE
 typedef double          FLOAT;
@@ -50,42 +144,206 @@ typedef int             INT32;
 typedef short           INT32;
 #endif
 typedef UINT8           BYTE;
-typedef UINT32          RGB;
 typedef size_t          SIZE_T;
+typedef unsigned long   BITBUF;         /* at least 32 bits, 64 on most 64-bit systems */
+
+#define BITBUF_SIZE             ((int) sizeof(BITBUF) * CHAR_BIT)
 
 typedef struct
 {
-    UINT16  value;
+    UINT32  value;
     UINT8   nbits;
 } BITCODE;
 
+typedef union MEMBLOCK
+{
+    struct
+    {
+        union MEMBLOCK  *prev, *next;
+    }       link;
+    double  align;                  /* keeps the memory that follows aligned */
+} MEMBLOCK, *pMEMBLOCK;
+
+typedef struct
+{
+    jmp_buf             jump;       /* where errors return to */
+    int                 error;      /* WSJPEG_ERROR_* raised */
+    wsjpeg_allocator    allocator;
+    MEMBLOCK            blocks;     /* live allocations, freed all at once after an error */
+} CONTEXT, *pCONTEXT;
+
 typedef struct
 {
+    pCONTEXT context;
     INT32   width;          /* positive:  left to right;  negative:  right to left */
     INT32   height;         /* positive:  bottom to top;  negative:  top to bottom */
-    BYTE    *data;          /* bitmap data (without header) */
+    BYTE    *data;          /* bitmap data (without header), or the rows of the current band */
+    BYTE    **rows;         /* rows held in data, from top to bottom */
+    FILE    *fp;            /* source of the bands when streaming, otherwise NULL */
+    long    offset;         /* file offset of the bitmap data (bfOffBits) */
+    SIZE_T  stride;         /* bytes per row, padded to a multiple of 4 */
+    UINT32  band_top;       /* first row held in data, counted from top to bottom */
+    UINT32  band_rows;      /* number of rows held in data */
+    int     external;       /* data belongs to the caller */
+    int     rgb;            /* pixels are R, G, B instead of B, G, R */
+    BYTE    *map;           /* the whole file when it is mapped, otherwise NULL */
+    SIZE_T  map_size;       /* bytes mapped */
 } BITMAP, *pBITMAP;
 
 typedef struct
 {
+    int     coef[64];               /* quantized coefficients in zigzag order */
+    UINT32  nonzero[2];             /* bit k % 32 of nonzero[k / 32] is set if coef[k] != 0 */
+} BLOCK, *pBLOCK;
+
+typedef union
+{
+    FLOAT   f[8][8];                /* output of dct_forward */
+    INT32   i[8][8];                /* output of dct_forward_int */
+} DCTBLOCK, *pDCTBLOCK;
+
+typedef struct
+{
+    UINT8   id;
+    UINT8   bits[16];
+    UINT8   huffval[256];
+} HUFFMAN;
+
+typedef wsjpeg_stats STATS, *pSTATS;
+
+typedef struct PIPE PIPE, *pPIPE;
+
+typedef struct
+{
+    int     lanes;                  /* blocks dct transforms at once, at most 8 */
+    void    (*gather[SAMPLING_COUNT])(const BYTE *bgr, SIZE_T stride, FLOAT blocks[][8][8]);
+    void    (*dct)(FLOAT blocks[][8][8]);
+    void    (*scale)(FLOAT matrix[8][8], FLOAT scale[8][8], int natural[8][8]);
+    FLOAT   (*spread)(FLOAT matrix[8][8]);
+    int     (*round)(FLOAT value);
+} KERNELS;
+
+typedef struct
+{
+    int     comps;                  /* components in the frame, 1 or 3 */
+    int     h[3], v[3];             /* sampling factors */
+    UINT32  mcu_width, mcu_height;  /* pixels per MCU */
+    int     blocks;                 /* blocks per MCU, at most 6 */
+    int     block_comp[6];          /* component of every block, in coding order */
+    void    (*gather_int)(const INT32 *table, const BYTE *bgr, SIZE_T stride, INT32 blocks[][8][8]);
+} SAMPLING;
+
+typedef struct
+{
+    pCONTEXT context;
     UINT8   quant_luma[8][8];
     UINT8   quant_chroma[8][8];
+    FLOAT   quant_scale[2][8][8];   /* 1 / (8 * s[v] * s[u] * quant), for luma and chroma */
+    FLOAT   flat_range[2];          /* widest spread of a block whose AC coefficients all quantize to 0 */
+    HUFFMAN huff[4];                /* tables in use, HUFF or optimized ones */
     BITCODE huff_table[4][256];
     BITCODE vli_table[4096];
+    BITCODE dc_code[2][4096];       /* DC code joined with the VLI bits, luma and chroma */
+    BITCODE ac_code[2][16][256];    /* AC run/size code joined with the VLI bits, values -128 - 127 */
     UINT32  width;                  /* always positive: left to right */
     UINT32  height;                 /* always positive: top to bottom */
     BYTE    *data;                  /* jpeg data */
     SIZE_T  capacity;               /* max bytes that data can hold */
+    SIZE_T  mcu_bound;              /* max bytes an MCU can take, see jpeg_mcu_bound */
     SIZE_T  size;                   /* the number of bytes stored in data */
-    UINT8   _buff, _nvacant;        /* bits buffer */
+    wsjpeg_write_fn write;          /* flush target, NULL to keep all of the data */
+    void    *opaque;                /* passed to write */
+    UINT32  x_unit_count;           /* MCUs per row */
+    UINT32  y_unit_count;           /* MCUs per column */
+    UINT16  restart_interval;       /* MCUs per restart interval, 0 if disabled */
+    int     dct_method;             /* DCT_FLOAT or DCT_INTEGER */
+    int     color_method;           /* COLOR_FLOAT or COLOR_INTEGER */
+    INT32   color_table[COLOR_TABLE_SIZE]; /* of color_init_int, only for COLOR_INTEGER */
+    int     pass;                   /* PASS_ENCODE, PASS_GATHER, PASS_REPLAY or PASS_CACHE */
+    UINT32  freq[4][257];           /* symbol counts of the gather pass, per table */
+    BYTE    *coefs;                 /* coefficients kept by the gather pass */
+    SIZE_T  coefs_size;             /* the number of bytes stored in coefs */
+    SIZE_T  coefs_capacity;         /* max bytes that coefs can hold */
+    SIZE_T  coefs_read;             /* bytes of coefs replayed */
+    pDCTBLOCK cache;                /* blocks kept by the cache pass, in coding order */
+    SIZE_T  cache_size;             /* the number of blocks stored in cache */
+    SIZE_T  cache_capacity;         /* max blocks that cache can hold */
+    SIZE_T  cache_read;             /* blocks of cache coded */
+    int     cached;                 /* nonzero to code the blocks of cache instead of the bitmap */
+    pSTATS  stats;                  /* where statistics are gathered, NULL if not wanted */
+    pPIPE   pipe;                   /* rows transformed by other threads, NULL to transform them here */
+    const SAMPLING *sampling;       /* chroma subsampling and MCU layout */
+    const KERNELS *kernels;         /* of the SIMD level in use */
+    void    (*gather)(const BYTE *bgr, SIZE_T stride, FLOAT blocks[][8][8]); /* the one of kernels for sampling */
+    double  _lap;                   /* when the stage being timed started */
+    BITBUF  _buff;                  /* bits buffer */
+    int     _nvacant;               /* free bits in _buff */
 } JPEG, *pJPEG;
 
-typedef const struct
+typedef wsjpeg_options OPTIONS, *pOPTIONS;
+
+typedef struct
 {
-    UINT8   id;
-    UINT8   bits[16];
-    UINT8   huffval[256];
-} HUFFMAN;
+    CONTEXT context;                /* private, errors can not cross threads */
+    pBITMAP bitmap;
+    JPEG    jpeg;                   /* private copy with its own output buffer */
+    STATS   stats;                  /* private statistics, added up afterwards */
+    UINT32  first, last;            /* range of restart intervals to encode */
+    pPIPE   pipe;                   /* the pipeline to transform rows for, NULL if none */
+} WORKER, *pWORKER;
+
+typedef struct
+{
+    pCONTEXT context;
+    BYTE    *data;                  /* the bytes written, as long as they stay within limit */
+    SIZE_T  size;                   /* bytes written, also past limit */
+    SIZE_T  capacity;               /* max bytes that data can hold */
+    SIZE_T  limit;
+} CAPPED, *pCAPPED;
+
+#ifdef USE_PTHREAD
+/*
+ * Rows of MCUs move from the transform threads to the coding
+ * thread through a ring of slots. Row r goes to slot r % slot_count
+ * and may only be transformed once the coder is done with row
+ * r - slot_count, so the ring never holds more than slot_count rows.
+ */
+struct PIPE
+{
+    BLOCK           *blocks;        /* slot_count rows of quantized blocks, 6 per MCU */
+    UINT32          *slot_row;      /* row held by every slot, PIPE_EMPTY if none */
+    UINT32          slot_count;
+    UINT32          next;           /* next row to transform */
+    UINT32          done;           /* rows the coder is done with */
+    int             error;          /* the first error of any thread, stops the pipeline */
+    pthread_mutex_t lock;           /* guards everything above but blocks */
+    pthread_cond_t  ready;          /* a row has been transformed */
+    pthread_cond_t  free;           /* a slot has been released, or the pipeline stops */
+};
+#endif
+
+struct wsjpeg_encoder
+{
+    CONTEXT context;
+    OPTIONS options;
+    STATS   stats;                  /* of the last encoding */
+    pJPEG   jpeg;                   /* tables and buffers kept between encodings, NULL until the first */
+    pBITMAP bitmap;                 /* being encoded, freed by encoder_run */
+};
+
+/* the input and output of a call of the library, for encoder_encode */
+typedef struct
+{
+    const BYTE          *pixels;    /* width * height RGB pixels, or NULL for bmp */
+    UINT32              width, height;
+    SIZE_T              stride;
+    const BYTE          *bmp;       /* a BMP file of size bytes */
+    SIZE_T              size;
+    wsjpeg_write_fn     write;      /* with opaque, unless there are outputs */
+    void                *opaque;
+    const wsjpeg_output *outputs;   /* count files of jpeg_encode_multi, or NULL */
+    int                 count;
+} REQUEST, *pREQUEST;
 
 const HUFFMAN HUFF[4] =
 {
@@ -195,7 +453,36 @@ const int JPEG_NATURAL_ORDER[] =
     53,  60,  61,  54,  47,  55,  62,  63,
 };
 
-void bitcode_tostring(BITCODE code, char string[17])
+const double AAN_SCALE_FACTOR[] =
+{
+    1.00000000000000000000,             /*  1.0                 */
+    1.38703984532214746182,             /*  cos(2pi/16)sqrt(2)  */
+    1.30656296487637652786,             /*  cos(3pi/16)sqrt(2)  */
+    1.17587560241935871697,             /*  cos(4pi/16)sqrt(2)  */
+    1.00000000000000000000,             /*  cos(5pi/16)sqrt(2)  */
+    0.78569495838710218128,             /*  cos(6pi/16)sqrt(2)  */
+    0.54119610014619698440,             /*  cos(7pi/16)sqrt(2)  */
+    0.27589937928294301234              /*  cos(8pi/16)sqrt(2)  */
+};
+
+/*
+ * Sum of |C(u)cos((2x+1)u*pi/16)| over x, so a coefficient of
+ * the forward DCT of samples within +-128 can not exceed
+ * 32 * DCT_GAIN[v] * DCT_GAIN[u].
+ */
+const double DCT_GAIN[] =
+{
+    5.65685424949238019520,
+    5.12583089548301298200,
+    5.22625185950550622080,
+    5.12583089548301298200,
+    5.65685424949238019520,
+    5.12583089548301298200,
+    5.22625185950550622080,
+    5.12583089548301298200
+};
+
+void bitcode_tostring(BITCODE code, char string[33])
 {
     int i, j = 0;
 
@@ -206,180 +493,1003 @@ void bitcode_tostring(BITCODE code, char string[17])
     string[j] = '\0';
 }
 
-void error_exit(char *message)
+int bit_ctz(UINT32 x)
 {
-    fprintf(stderr, "Error: %s\n", message);
-    exit(EXIT_FAILURE);
+    /* index of the lowest set bit, x must not be zero */
+#if defined(__GNUC__)
+    return __builtin_ctz(x);
+#else
+    static const int DE_BRUIJN[32] =
+    {
+         0,  1, 28,  2, 29, 14, 24,  3, 30, 22, 20, 15, 25, 17,  4,  8,
+        31, 27, 13, 23, 21, 19, 16,  7, 26, 12, 18,  6, 11,  5, 10,  9
+    };
+    return DE_BRUIJN[((x & (0 - x)) * 0x077CB531UL & 0xFFFFFFFFUL) >> 27];
+#endif
 }
 
-pBITMAP bitmap_read(FILE *fp)
+void *std_malloc(void *opaque, size_t size)
 {
-    pBITMAP bitmap;
-    BYTE header[54];
-    SIZE_T bitmap_size;
+    (void) opaque;
+    return malloc(size);
+}
+
+void *std_realloc(void *opaque, void *ptr, size_t size)
+{
+    (void) opaque;
+    return realloc(ptr, size);
+}
+
+void std_free(void *opaque, void *ptr)
+{
+    (void) opaque;
+    free(ptr);
+}
+
+void context_init(pCONTEXT context, const wsjpeg_allocator *allocator)
+{
+    const wsjpeg_allocator std_allocator = {std_malloc, std_realloc, std_free, NULL};
+
+    context->error = WSJPEG_OK;
+    context->allocator = (allocator != NULL) ? *allocator : std_allocator;
+    context->blocks.link.prev = context->blocks.link.next = &context->blocks;
+}
+
+void error_raise(pCONTEXT context, int error)
+{
+    /* unwind to the setjmp of the running encoder */
+    context->error = error;
+    longjmp(context->jump, 1);
+}
+
+void *mem_alloc(pCONTEXT context, SIZE_T size)
+{
+    /*
+     * Every allocation is linked into the context, so that an
+     * error can release everything that is still in use.
+     */
+    pMEMBLOCK block, head = &context->blocks;
 
-    if (fp == NULL)
+    if (size > (SIZE_T) -1 - sizeof(MEMBLOCK) ||
+        (block = context->allocator.malloc_fn(context->allocator.opaque, sizeof(MEMBLOCK) + size)) == NULL)
     {
-        error_exit(BMP_OPEN_ERROR);
+        error_raise(context, WSJPEG_ERROR_MEMORY);
+    }
+    block->link.prev = head;
+    block->link.next = head->link.next;
+    head->link.next->link.prev = block;
+    head->link.next = block;
+    return block + 1;
+}
+
+void *mem_realloc(pCONTEXT context, void *ptr, SIZE_T size)
+{
+    pMEMBLOCK block = (pMEMBLOCK) ptr - 1;
+
+    if (size > (SIZE_T) -1 - sizeof(MEMBLOCK) ||
+        (block = context->allocator.realloc_fn(context->allocator.opaque, block, sizeof(MEMBLOCK) + size)) == NULL)
+    {
+        error_raise(context, WSJPEG_ERROR_MEMORY);
+    }
+    block->link.prev->link.next = block;
+    block->link.next->link.prev = block;
+    return block + 1;
+}
+
+void mem_free(pCONTEXT context, void *ptr)
+{
+    pMEMBLOCK block = (pMEMBLOCK) ptr - 1;
+
+    block->link.prev->link.next = block->link.next;
+    block->link.next->link.prev = block->link.prev;
+    context->allocator.free_fn(context->allocator.opaque, block);
+}
+
+void mem_free_all(pCONTEXT context)
+{
+    while (context->blocks.link.next != &context->blocks)
+    {
+        mem_free(context, context->blocks.link.next + 1);
     }
+}
+
+void mem_adopt(pCONTEXT context, pCONTEXT from)
+{
+    /* move the allocations of from into context */
+    pMEMBLOCK head = &context->blocks, first, last;
 
-    if ((bitmap = malloc(sizeof(BITMAP))) == NULL)
+    if (from->blocks.link.next == &from->blocks)
     {
-        error_exit(OUT_OF_MEMORY_ERROR);
+        return;
     }
+    first = from->blocks.link.next;
+    last = from->blocks.link.prev;
+    first->link.prev = head;
+    last->link.next = head->link.next;
+    head->link.next->link.prev = last;
+    head->link.next = first;
+    from->blocks.link.prev = from->blocks.link.next = &from->blocks;
+}
+
+pBITMAP bitmap_create(pCONTEXT context, const BYTE header[54])
+{
+    pBITMAP bitmap;
 
-    if (fread(header, 1, 54, fp) < 54 || header[0] != 'B' || header[1] != 'M')
+    if (header[0] != 'B' || header[1] != 'M')
     {
-        error_exit(BMP_INVALID_ERROR);
+        error_raise(context, WSJPEG_ERROR_BMP_INVALID);
+    }
+    if ((header[28] | header[29] << 8) != 24)
+    {
+        error_raise(context, WSJPEG_ERROR_BMP_NOT_24BIT);
     }
 
+    bitmap = mem_alloc(context, sizeof(BITMAP));
+    bitmap->context = context;
+    bitmap->offset = (long) ((UINT32) header[10]       | (UINT32) header[11] << 8 |
+                             (UINT32) header[12] << 16 | (UINT32) header[13] << 24);
     bitmap->width  = (UINT32) header[18]       | (UINT32) header[19] << 8 |
                      (UINT32) header[20] << 16 | (UINT32) header[21] << 24;
     bitmap->height = (UINT32) header[22]       | (UINT32) header[23] << 8 |
                      (UINT32) header[24] << 16 | (UINT32) header[25] << 24;
 
-    if ((header[28] | header[29] << 8) != 24)
+    if (labs(bitmap->width) > 65535 || labs(bitmap->height) > 65535)
     {
-        error_exit(BMP_NOT_24BIT_ERROR);
+        error_raise(context, WSJPEG_ERROR_TOO_LARGE);
     }
+    if (bitmap->width == 0 || bitmap->height == 0)
+    {
+        /* a SOF can not have 0 samples per line, and 0 lines needs a DNL marker */
+        error_raise(context, WSJPEG_ERROR_BMP_CORRUPT);
+    }
+
+    bitmap->stride = (3 + labs(bitmap->width) * 3) & ~3;
+    bitmap->data = NULL;
+    bitmap->rows = NULL;
+    bitmap->fp = NULL;
+    bitmap->band_top = 0;
+    bitmap->band_rows = 0;
+    bitmap->external = 0;
+    bitmap->rgb = 0;
+    bitmap->map = NULL;
+    bitmap->map_size = 0;
+
+    return bitmap;
+}
+
+void bitmap_index_rows(pBITMAP bitmap)
+{
+    /* index the rows once, so that the orientation is not looked at again */
+    UINT32 i, rows = bitmap->band_rows;
 
-    bitmap_size = labs(bitmap->height) * ((3 + labs(bitmap->width) * 3) & ~3);
-    if ((bitmap->data = malloc(bitmap_size)) == NULL)
+    for (i = 0; i < rows; i++)
     {
-        error_exit(OUT_OF_MEMORY_ERROR);
+        bitmap->rows[i] = bitmap->data + ((bitmap->height < 0) ? i : rows - i - 1) * bitmap->stride;
     }
+}
+
+pBITMAP bitmap_open(pCONTEXT context, FILE *fp)
+{
+    pBITMAP bitmap;
+    BYTE header[54];
 
-    if (fread(bitmap->data, 1, bitmap_size, fp) < bitmap_size)
+    if (fread(header, 1, 54, fp) < 54)
     {
-        error_exit(BMP_CORRUPT_ERROR);
+        error_raise(context, WSJPEG_ERROR_BMP_INVALID);
     }
+    bitmap = bitmap_create(context, header);
+    bitmap->fp = fp;
 
     return bitmap;
 }
 
-RGB bitmap_get_rgb(pBITMAP bitmap, UINT32 x, UINT32 y)
+pBITMAP bitmap_open_memory(pCONTEXT context, const BYTE *bmp, SIZE_T size)
 {
-    UINT32 width_abs, height_abs, a, b;
-    RGB rgb_pixel = 0;
-    SIZE_T pos;
+    pBITMAP bitmap;
+    UINT32 height_abs;
 
-    width_abs  = labs(bitmap->width);
+    if (size < 54)
+    {
+        error_raise(context, WSJPEG_ERROR_BMP_INVALID);
+    }
+    bitmap = bitmap_create(context, bmp);
     height_abs = labs(bitmap->height);
-    if (x < 0 || y < 0 || x >= width_abs || y >= height_abs)
+    if (bitmap->offset < 54 || (SIZE_T) bitmap->offset > size ||
+        (size - bitmap->offset) / bitmap->stride < height_abs)
     {
-        return 0;
+        error_raise(context, WSJPEG_ERROR_BMP_CORRUPT);
     }
-    a = (bitmap->height < 0) ? y :  height_abs - y - 1;
-    b = (bitmap->width  > 0) ? x :  width_abs  - x - 1;
 
-    pos = a * ((3 + width_abs * 3) & ~3) + b * 3;
-    rgb_pixel |= ((RGB) bitmap->data[pos++] << 16);
-    rgb_pixel |= ((RGB) bitmap->data[pos++] << 8 );
-    rgb_pixel |= ((RGB) bitmap->data[pos++]      );
+    /* the pixels are used in place */
+    bitmap->data = (BYTE *) bmp + bitmap->offset;
+    bitmap->external = 1;
+    bitmap->rows = mem_alloc(context, height_abs * sizeof(BYTE *));
+    bitmap->band_rows = height_abs;
+    bitmap_index_rows(bitmap);
 
-    return rgb_pixel;
+    return bitmap;
 }
 
-void bitmap_free(pBITMAP bitmap)
+pBITMAP bitmap_open_rgb(pCONTEXT context, const BYTE *pixels, UINT32 width, UINT32 height, SIZE_T stride)
 {
-    free(bitmap->data);
-    free(bitmap);
+    pBITMAP bitmap;
+
+    if (width > 65535 || height > 65535)
+    {
+        error_raise(context, WSJPEG_ERROR_TOO_LARGE);
+    }
+
+    bitmap = mem_alloc(context, sizeof(BITMAP));
+    bitmap->context = context;
+    bitmap->width = width;
+    bitmap->height = -(INT32) height;               /* top to bottom */
+    bitmap->stride = stride;
+    bitmap->offset = 0;
+    bitmap->data = (BYTE *) pixels;
+    bitmap->rows = mem_alloc(context, height * sizeof(BYTE *));
+    bitmap->fp = NULL;
+    bitmap->band_top = 0;
+    bitmap->band_rows = height;
+    bitmap->external = 1;
+    bitmap->rgb = 1;
+    bitmap->map = NULL;
+    bitmap->map_size = 0;
+    bitmap_index_rows(bitmap);
+
+    return bitmap;
 }
 
-FLOAT rgb_to_ycc(RGB rgb_pixel, int comp)
+#ifdef USE_MMAP
+pBITMAP bitmap_open_mapped(pCONTEXT context, FILE *fp)
 {
-    UINT8 r, g, b;
+    /*
+     * Map the file read-only and use the pixels in place, so
+     * that nothing is copied and only the pages that are being
+     * coded have to be resident. Returns NULL if the file can
+     * not be mapped, a pipe for example.
+     */
+    pBITMAP bitmap;
+    struct stat st;
+    void *map;
+    jmp_buf jump;
+
+    if (fstat(fileno(fp), &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0 ||
+        (off_t) (SIZE_T) st.st_size != st.st_size)
+    {
+        return NULL;
+    }
+    map = mmap(NULL, (SIZE_T) st.st_size, PROT_READ, MAP_PRIVATE, fileno(fp), 0);
+    if (map == MAP_FAILED)
+    {
+        return NULL;
+    }
+    posix_madvise(map, (SIZE_T) st.st_size, POSIX_MADV_SEQUENTIAL);
 
-    r =  rgb_pixel        & 0xff;
-    g = (rgb_pixel >> 8)  & 0xff;
-    b = (rgb_pixel >> 16) & 0xff;
-    switch (comp)
+    /* a broken file must not leave the mapping behind */
+    memcpy(jump, context->jump, sizeof(jmp_buf));
+    if (setjmp(context->jump) != 0)
     {
-        /*  Y */ case 0:    return (       0.299 * r +       0.587 * g +       0.114 * b);
-        /* Cb */ case 1:    return (-0.168735892 * r - 0.331264108 * g +         0.5 * b) + 128;
-        /* Cr */ case 2:    return (         0.5 * r - 0.418687589 * g - 0.081312411 * b) + 128;
-                default:    return 0;
+        memcpy(context->jump, jump, sizeof(jmp_buf));
+        munmap(map, (SIZE_T) st.st_size);
+        error_raise(context, context->error);
     }
+    bitmap = bitmap_open_memory(context, map, (SIZE_T) st.st_size);
+    memcpy(context->jump, jump, sizeof(jmp_buf));
+    bitmap->map = map;
+    bitmap->map_size = (SIZE_T) st.st_size;
+
+    return bitmap;
 }
+#endif
 
-void dct_init(int quality, pJPEG jpeg)
+void bitmap_prefetch(pBITMAP bitmap, UINT32 top, UINT32 rows)
 {
-    int i, j, factor, quant;
-    if (quality <= 0)
+    /* ask for the pages of the rows that will be coded next, if the file is mapped */
+#ifdef USE_MMAP
+    UINT32 height_abs, first;
+    SIZE_T page, begin, end;
+
+    height_abs = labs(bitmap->height);
+    if (bitmap->map == NULL || top >= height_abs)
     {
-        factor = 5000;
+        return;
     }
-    else if (quality < 50)
+    if (top + rows > height_abs)
     {
-        factor = 5000 / quality;
+        rows = height_abs - top;
     }
-    else if (quality <= 100)
+    first = (bitmap->height < 0) ? top : height_abs - top - rows;
+    page = (SIZE_T) sysconf(_SC_PAGESIZE);
+    begin = bitmap->offset + first * bitmap->stride;
+    end = begin + rows * bitmap->stride;
+    begin -= begin % page;
+    posix_madvise(bitmap->map + begin, end - begin, POSIX_MADV_WILLNEED);
+#else
+    (void) bitmap;
+    (void) top;
+    (void) rows;
+#endif
+}
+
+void bitmap_read_band(pBITMAP bitmap, UINT32 top, UINT32 rows)
+{
+    UINT32 height_abs, first;
+    SIZE_T band_size;
+
+    /*
+     * The rows of a band are contiguous in the file for both
+     * orientations, only reversed for bottom-up bitmaps, so a
+     * single seek and read is enough.
+     */
+    height_abs = labs(bitmap->height);
+    if (top + rows > height_abs)
     {
-        factor = 200 - quality * 2;
+        rows = height_abs - top;
     }
-    else
+    first = (bitmap->height < 0) ? top : height_abs - top - rows;
+    band_size = rows * bitmap->stride;
+
+    if (bitmap->offset < 54)
     {
-        factor = 0;
+        error_raise(bitmap->context, WSJPEG_ERROR_BMP_CORRUPT);
     }
-    for (j = 0; j < 8; j++)
+    if (first > (SIZE_T) (LONG_MAX - bitmap->offset) / bitmap->stride)
     {
-        for (i = 0; i < 8; i++)
+        /* fseek can not reach the band */
+        error_raise(bitmap->context, WSJPEG_ERROR_TOO_LARGE);
+    }
+    if (fseek(bitmap->fp, bitmap->offset + (long) first * (long) bitmap->stride, SEEK_SET) != 0 ||
+        fread(bitmap->data, 1, band_size, bitmap->fp) < band_size)
+    {
+        error_raise(bitmap->context, WSJPEG_ERROR_BMP_CORRUPT);
+    }
+    bitmap->band_top = top;
+    bitmap->band_rows = rows;
+    bitmap_index_rows(bitmap);
+}
+
+pBITMAP bitmap_read(pCONTEXT context, FILE *fp)
+{
+    pBITMAP bitmap;
+    UINT32 height_abs;
+    SIZE_T data_size;
+    long skip;
+
+    /*
+     * Read front to back without seeking, so that pipes work too;
+     * only the band reader of bitmap_open_stream needs to seek.
+     */
+    bitmap = bitmap_open(context, fp);
+    if (bitmap->offset < 54)
+    {
+        error_raise(context, WSJPEG_ERROR_BMP_CORRUPT);
+    }
+    for (skip = bitmap->offset - 54; skip > 0; skip--)
+    {
+        if (getc(fp) == EOF)
         {
-            quant = (QUANT_LUMA[j][i] * factor + 50) / 100;
-            if (quant <= 0)
-            {
-                quant = 1;
-            }
-            else if (quant > 255)
-            {
-                quant = 255;
-            }
-            jpeg->quant_luma[j][i] = quant;
+            error_raise(context, WSJPEG_ERROR_BMP_CORRUPT);
         }
     }
-    for (j = 0; j < 8; j++)
+
+    height_abs = labs(bitmap->height);
+    data_size = height_abs * bitmap->stride;
+    bitmap->data = mem_alloc(context, data_size);
+    bitmap->rows = mem_alloc(context, height_abs * sizeof(BYTE *));
+    if (fread(bitmap->data, 1, data_size, fp) < data_size)
     {
-        for (i = 0; i < 8; i++)
+        error_raise(context, WSJPEG_ERROR_BMP_CORRUPT);
+    }
+    bitmap->band_top = 0;
+    bitmap->band_rows = height_abs;
+    bitmap_index_rows(bitmap);
+    bitmap->fp = NULL;                              /* all rows are in memory */
+
+    return bitmap;
+}
+
+pBITMAP bitmap_open_stream(pCONTEXT context, FILE *fp, UINT32 band_height)
+{
+    pBITMAP bitmap;
+
+    bitmap = bitmap_open(context, fp);
+    bitmap->data = mem_alloc(context, band_height * bitmap->stride);
+    bitmap->rows = mem_alloc(context, band_height * sizeof(BYTE *));
+
+    return bitmap;
+}
+
+void bitmap_get_rows(pBITMAP bitmap, UINT32 top, UINT32 count, UINT32 width, BYTE *staging)
+{
+    /*
+     * Copy count rows from row top on into staging, width pixels
+     * per row, left to right. The rows have to be in the current
+     * band. Pixels outside of the bitmap repeat the last column
+     * and the last row, which compresses better than black.
+     */
+    UINT32 width_abs, height_abs, n, x, y;
+    BYTE *row, *bgr, temp;
+
+    width_abs  = labs(bitmap->width);
+    height_abs = labs(bitmap->height);
+    n = (width_abs < width) ? width_abs : width;
+    for (y = top; y < top + count; y++)
+    {
+        row = bitmap->rows[((y < height_abs) ? y : height_abs - 1) - bitmap->band_top];
+        bgr = staging + (y - top) * width * 3;
+        if (bitmap->width > 0)
         {
-            quant = (QUANT_CHROMA[j][i] * factor + 50) / 100;
-            if (quant <= 0)
+            memcpy(bgr, row, n * 3);
+        }
+        else
+        {
+            for (x = 0; x < n; x++)
             {
-                quant = 1;
+                memcpy(bgr + x * 3, row + (width_abs - x - 1) * 3, 3);
             }
-            else if (quant > 255)
+        }
+        if (bitmap->rgb)
+        {
+            for (x = 0; x < n; x++)
             {
-                quant = 255;
+                temp = bgr[x * 3];
+                bgr[x * 3] = bgr[x * 3 + 2];
+                bgr[x * 3 + 2] = temp;
             }
-            jpeg->quant_chroma[j][i] = quant;
+        }
+        for (x = n; x < width; x++)
+        {
+            memcpy(bgr + x * 3, bgr + (n - 1) * 3, 3);
         }
     }
 }
 
-void dct_forward(FLOAT matrix[8][8])
+void bitmap_free(pBITMAP bitmap)
 {
-    /*
-     * Reference:   Arai, Y., Agui, T. and Nakajima, M. (1988) A
-     *              Fast DCT-SQ Scheme for Images. Transactions-
-     *              IEICE, E-71, 1095-1097.
-     */
-    const FLOAT AAN_SCALE_FACTOR[] =
+    pCONTEXT context = bitmap->context;
+
+    if (bitmap->rows != NULL)
     {
-        1.00000000000000000000,             /*  1.0                 */
-        1.38703984532214746182,             /*  cos(2pi/16)sqrt(2)  */
-        1.30656296487637652786,             /*  cos(3pi/16)sqrt(2)  */
-        1.17587560241935871697,             /*  cos(4pi/16)sqrt(2)  */
-        1.00000000000000000000,             /*  cos(5pi/16)sqrt(2)  */
-        0.78569495838710218128,             /*  cos(6pi/16)sqrt(2)  */
-        0.54119610014619698440,             /*  cos(7pi/16)sqrt(2)  */
-        0.27589937928294301234              /*  cos(8pi/16)sqrt(2)  */
-    };
+        mem_free(context, bitmap->rows);
+    }
+    if (bitmap->data != NULL && !bitmap->external)
+    {
+        mem_free(context, bitmap->data);
+    }
+#ifdef USE_MMAP
+    if (bitmap->map != NULL)
+    {
+        munmap(bitmap->map, bitmap->map_size);
+    }
+#endif
+    mem_free(context, bitmap);
+}
+
+void color_convert(const BYTE *bgr, int count, FLOAT *y, FLOAT *cb, FLOAT *cr)
+{
+    /*
+     * Convert a span of BGR pixels into level shifted Y, Cb and
+     * Cr samples (T.871). The vector versions load each pixel as
+     * a 32-bit word, so bgr must be readable one byte past the
+     * last pixel.
+     */
+    int i;
+    UINT8 r, g, b;
+
+    for (i = 0; i < count; i++)
+    {
+        b = bgr[i * 3    ];
+        g = bgr[i * 3 + 1];
+        r = bgr[i * 3 + 2];
+        /*  Y */ y [i] = (       0.299 * r +       0.587 * g +       0.114 * b) - 128;
+        /* Cb */ cb[i] = (-0.168735892 * r - 0.331264108 * g +         0.5 * b);
+        /* Cr */ cr[i] = (         0.5 * r - 0.418687589 * g - 0.081312411 * b);
+    }
+}
+
+void color_convert_gray(const BYTE *bgr, int count, FLOAT *y)
+{
+    /* only the Y samples of color_convert, computed the same way */
+    int i;
+    UINT8 r, g, b;
+
+    for (i = 0; i < count; i++)
+    {
+        b = bgr[i * 3    ];
+        g = bgr[i * 3 + 1];
+        r = bgr[i * 3 + 2];
+        y[i] = (0.299 * r + 0.587 * g + 0.114 * b) - 128;
+    }
+}
+
+void color_convert_subsample(const BYTE *bgr, SIZE_T stride, int rows, int count,
+                             FLOAT *y0, FLOAT *y1, FLOAT *cb, FLOAT *cr)
+{
+    /*
+     * Convert count pixels, an even number, of one row or of two
+     * rows stride bytes apart into Y samples like color_convert,
+     * y1 for the second row. Cb and Cr are linear in RGB, so each
+     * 2x1 or 2x2 group gets the mean of their chroma by converting
+     * the mean of its pixels once. bgr must be readable one byte
+     * past the last pixel of each row, as for color_convert.
+     */
+    int i, row, a;
+    UINT32 sr, sg, sb;
+    UINT8 r, g, b;
+    const BYTE *p;
+    FLOAT *y;
+
+    for (i = 0; i + 2 <= count; i += 2)
+    {
+        sr = sg = sb = 0;
+        for (row = 0; row < rows; row++)
+        {
+            y = row ? y1 : y0;
+            p = bgr + row * stride + i * 3;
+            for (a = 0; a < 2; a++)
+            {
+                b = p[a * 3    ];
+                g = p[a * 3 + 1];
+                r = p[a * 3 + 2];
+                y[i + a] = (0.299 * r + 0.587 * g + 0.114 * b) - 128;
+                sr += r;
+                sg += g;
+                sb += b;
+            }
+        }
+        /* Cb */ cb[i / 2] = (-0.168735892 * sr - 0.331264108 * sg +         0.5 * sb) / (rows * 2);
+        /* Cr */ cr[i / 2] = (         0.5 * sr - 0.418687589 * sg - 0.081312411 * sb) / (rows * 2);
+    }
+}
+
+#ifdef SIMD_SSE2
+SIMD_TARGET("sse2") void color_convert_sse2(const BYTE *bgr, int count, FLOAT *y, FLOAT *cb, FLOAT *cr)
+{
+    /* color_convert four pixels at a time */
+    const __m128i mask = _mm_set1_epi32(0xff);
+    __m128i pixel;
+    __m128 vr, vg, vb;
+    INT32 word[4];
+    int i;
+
+    for (i = 0; i + 4 <= count; i += 4)
+    {
+        memcpy(&word[0], bgr + i * 3    , 4);
+        memcpy(&word[1], bgr + i * 3 + 3, 4);
+        memcpy(&word[2], bgr + i * 3 + 6, 4);
+        memcpy(&word[3], bgr + i * 3 + 9, 4);
+        pixel = _mm_loadu_si128((const __m128i *) word);
+        vb = _mm_cvtepi32_ps(_mm_and_si128(pixel, mask));
+        vg = _mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(pixel, 8), mask));
+        vr = _mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(pixel, 16), mask));
+        _mm_storeu_ps(y + i, _mm_add_ps(_mm_add_ps(
+            _mm_mul_ps(vr, _mm_set1_ps(0.299f)),
+            _mm_mul_ps(vg, _mm_set1_ps(0.587f))),
+            _mm_add_ps(_mm_mul_ps(vb, _mm_set1_ps(0.114f)), _mm_set1_ps(-128.0f))));
+        _mm_storeu_ps(cb + i, _mm_add_ps(_mm_sub_ps(
+            _mm_mul_ps(vb, _mm_set1_ps(0.5f)),
+            _mm_mul_ps(vr, _mm_set1_ps(0.168735892f))),
+            _mm_mul_ps(vg, _mm_set1_ps(-0.331264108f))));
+        _mm_storeu_ps(cr + i, _mm_add_ps(_mm_sub_ps(
+            _mm_mul_ps(vr, _mm_set1_ps(0.5f)),
+            _mm_mul_ps(vg, _mm_set1_ps(0.418687589f))),
+            _mm_mul_ps(vb, _mm_set1_ps(-0.081312411f))));
+    }
+    color_convert(bgr + i * 3, count - i, y + i, cb + i, cr + i);
+}
+
+SIMD_TARGET("sse2") void color_convert_gray_sse2(const BYTE *bgr, int count, FLOAT *y)
+{
+    const __m128i mask = _mm_set1_epi32(0xff);
+    __m128i pixel;
+    __m128 vr, vg, vb;
+    INT32 word[4];
+    int i;
+
+    for (i = 0; i + 4 <= count; i += 4)
+    {
+        memcpy(&word[0], bgr + i * 3    , 4);
+        memcpy(&word[1], bgr + i * 3 + 3, 4);
+        memcpy(&word[2], bgr + i * 3 + 6, 4);
+        memcpy(&word[3], bgr + i * 3 + 9, 4);
+        pixel = _mm_loadu_si128((const __m128i *) word);
+        vb = _mm_cvtepi32_ps(_mm_and_si128(pixel, mask));
+        vg = _mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(pixel, 8), mask));
+        vr = _mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(pixel, 16), mask));
+        _mm_storeu_ps(y + i, _mm_add_ps(_mm_add_ps(
+            _mm_mul_ps(vr, _mm_set1_ps(0.299f)),
+            _mm_mul_ps(vg, _mm_set1_ps(0.587f))),
+            _mm_add_ps(_mm_mul_ps(vb, _mm_set1_ps(0.114f)), _mm_set1_ps(-128.0f))));
+    }
+    color_convert_gray(bgr + i * 3, count - i, y + i);
+}
+
+SIMD_TARGET("sse2") void color_convert_subsample_sse2(const BYTE *bgr, SIZE_T stride, int rows, int count,
+                                                      FLOAT *y0, FLOAT *y1, FLOAT *cb, FLOAT *cr)
+{
+    const __m128i mask  = _mm_set1_epi32(0xff);
+    const __m128  scale = _mm_set1_ps((rows == 2) ? 0.25f : 0.5f);
+    __m128i pixel;
+    __m128 vr, vg, vb, lr, lg, lb, hr, hg, hb;
+    INT32 word[4];
+    int i, row, a;
+    const BYTE *p;
+    FLOAT *y;
+
+    for (i = 0; i + 8 <= count; i += 8)
+    {
+        lr = lg = lb = hr = hg = hb = _mm_setzero_ps();
+        for (row = 0; row < rows; row++)
+        {
+            y = (row ? y1 : y0) + i;
+            p = bgr + row * stride + i * 3;
+            for (a = 0; a < 8; a += 4)
+            {
+                memcpy(&word[0], p + a * 3    , 4);
+                memcpy(&word[1], p + a * 3 + 3, 4);
+                memcpy(&word[2], p + a * 3 + 6, 4);
+                memcpy(&word[3], p + a * 3 + 9, 4);
+                pixel = _mm_loadu_si128((const __m128i *) word);
+                vb = _mm_cvtepi32_ps(_mm_and_si128(pixel, mask));
+                vg = _mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(pixel, 8), mask));
+                vr = _mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(pixel, 16), mask));
+                _mm_storeu_ps(y + a, _mm_add_ps(_mm_add_ps(
+                    _mm_mul_ps(vr, _mm_set1_ps(0.299f)),
+                    _mm_mul_ps(vg, _mm_set1_ps(0.587f))),
+                    _mm_add_ps(_mm_mul_ps(vb, _mm_set1_ps(0.114f)), _mm_set1_ps(-128.0f))));
+                if (a == 0)
+                {
+                    lr = _mm_add_ps(lr, vr);
+                    lg = _mm_add_ps(lg, vg);
+                    lb = _mm_add_ps(lb, vb);
+                }
+                else
+                {
+                    hr = _mm_add_ps(hr, vr);
+                    hg = _mm_add_ps(hg, vg);
+                    hb = _mm_add_ps(hb, vb);
+                }
+            }
+        }
+        /* pairwise sums of the 8 columns, even plus odd lanes */
+        vr = _mm_add_ps(_mm_shuffle_ps(lr, hr, 0x88), _mm_shuffle_ps(lr, hr, 0xdd));
+        vg = _mm_add_ps(_mm_shuffle_ps(lg, hg, 0x88), _mm_shuffle_ps(lg, hg, 0xdd));
+        vb = _mm_add_ps(_mm_shuffle_ps(lb, hb, 0x88), _mm_shuffle_ps(lb, hb, 0xdd));
+        vr = _mm_mul_ps(vr, scale);
+        vg = _mm_mul_ps(vg, scale);
+        vb = _mm_mul_ps(vb, scale);
+        _mm_storeu_ps(cb + i / 2, _mm_add_ps(_mm_sub_ps(
+            _mm_mul_ps(vb, _mm_set1_ps(0.5f)),
+            _mm_mul_ps(vr, _mm_set1_ps(0.168735892f))),
+            _mm_mul_ps(vg, _mm_set1_ps(-0.331264108f))));
+        _mm_storeu_ps(cr + i / 2, _mm_add_ps(_mm_sub_ps(
+            _mm_mul_ps(vr, _mm_set1_ps(0.5f)),
+            _mm_mul_ps(vg, _mm_set1_ps(0.418687589f))),
+            _mm_mul_ps(vb, _mm_set1_ps(-0.081312411f))));
+    }
+    color_convert_subsample(bgr + i * 3, stride, rows, count - i, y0 + i, (rows == 2) ? y1 + i : NULL,
+                            cb + i / 2, cr + i / 2);
+}
+#endif
+
+#ifdef SIMD_AVX2
+SIMD_TARGET("avx2") void color_convert_avx2(const BYTE *bgr, int count, FLOAT *y, FLOAT *cb, FLOAT *cr)
+{
+    /* color_convert eight pixels at a time, gathered straight from bgr */
+    const __m256i index = _mm256_setr_epi32(0, 3, 6, 9, 12, 15, 18, 21);
+    const __m256i mask  = _mm256_set1_epi32(0xff);
+    __m256i pixel;
+    __m256 vr, vg, vb;
+    int i;
+
+    for (i = 0; i + 8 <= count; i += 8)
+    {
+        pixel = _mm256_i32gather_epi32((const int *) (bgr + i * 3), index, 1);
+        vb = _mm256_cvtepi32_ps(_mm256_and_si256(pixel, mask));
+        vg = _mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(pixel, 8), mask));
+        vr = _mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(pixel, 16), mask));
+        _mm256_storeu_ps(y + i, _mm256_add_ps(_mm256_add_ps(
+            _mm256_mul_ps(vr, _mm256_set1_ps(0.299f)),
+            _mm256_mul_ps(vg, _mm256_set1_ps(0.587f))),
+            _mm256_add_ps(_mm256_mul_ps(vb, _mm256_set1_ps(0.114f)), _mm256_set1_ps(-128.0f))));
+        _mm256_storeu_ps(cb + i, _mm256_add_ps(_mm256_sub_ps(
+            _mm256_mul_ps(vb, _mm256_set1_ps(0.5f)),
+            _mm256_mul_ps(vr, _mm256_set1_ps(0.168735892f))),
+            _mm256_mul_ps(vg, _mm256_set1_ps(-0.331264108f))));
+        _mm256_storeu_ps(cr + i, _mm256_add_ps(_mm256_sub_ps(
+            _mm256_mul_ps(vr, _mm256_set1_ps(0.5f)),
+            _mm256_mul_ps(vg, _mm256_set1_ps(0.418687589f))),
+            _mm256_mul_ps(vb, _mm256_set1_ps(-0.081312411f))));
+    }
+    color_convert(bgr + i * 3, count - i, y + i, cb + i, cr + i);
+}
+
+SIMD_TARGET("avx2") void color_convert_gray_avx2(const BYTE *bgr, int count, FLOAT *y)
+{
+    const __m256i index = _mm256_setr_epi32(0, 3, 6, 9, 12, 15, 18, 21);
+    const __m256i mask  = _mm256_set1_epi32(0xff);
+    __m256i pixel;
+    __m256 vr, vg, vb;
+    int i;
+
+    for (i = 0; i + 8 <= count; i += 8)
+    {
+        pixel = _mm256_i32gather_epi32((const int *) (bgr + i * 3), index, 1);
+        vb = _mm256_cvtepi32_ps(_mm256_and_si256(pixel, mask));
+        vg = _mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(pixel, 8), mask));
+        vr = _mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(pixel, 16), mask));
+        _mm256_storeu_ps(y + i, _mm256_add_ps(_mm256_add_ps(
+            _mm256_mul_ps(vr, _mm256_set1_ps(0.299f)),
+            _mm256_mul_ps(vg, _mm256_set1_ps(0.587f))),
+            _mm256_add_ps(_mm256_mul_ps(vb, _mm256_set1_ps(0.114f)), _mm256_set1_ps(-128.0f))));
+    }
+    color_convert_gray(bgr + i * 3, count - i, y + i);
+}
+
+SIMD_TARGET("avx2") void color_convert_subsample_avx2(const BYTE *bgr, SIZE_T stride, int rows, int count,
+                                                      FLOAT *y0, FLOAT *y1, FLOAT *cb, FLOAT *cr)
+{
+    const __m256i index = _mm256_setr_epi32(0, 3, 6, 9, 12, 15, 18, 21);
+    const __m256i mask  = _mm256_set1_epi32(0xff);
+    const __m256  scale = _mm256_set1_ps((rows == 2) ? 0.25f : 0.5f);
+    __m256i pixel;
+    __m256 vr, vg, vb, lr, lg, lb, hr, hg, hb;
+    int i, row, a;
+    const BYTE *p;
+    FLOAT *y;
+
+    for (i = 0; i + 16 <= count; i += 16)
+    {
+        lr = lg = lb = hr = hg = hb = _mm256_setzero_ps();
+        for (row = 0; row < rows; row++)
+        {
+            y = (row ? y1 : y0) + i;
+            p = bgr + row * stride + i * 3;
+            for (a = 0; a < 16; a += 8)
+            {
+                pixel = _mm256_i32gather_epi32((const int *) (p + a * 3), index, 1);
+                vb = _mm256_cvtepi32_ps(_mm256_and_si256(pixel, mask));
+                vg = _mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(pixel, 8), mask));
+                vr = _mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(pixel, 16), mask));
+                _mm256_storeu_ps(y + a, _mm256_add_ps(_mm256_add_ps(
+                    _mm256_mul_ps(vr, _mm256_set1_ps(0.299f)),
+                    _mm256_mul_ps(vg, _mm256_set1_ps(0.587f))),
+                    _mm256_add_ps(_mm256_mul_ps(vb, _mm256_set1_ps(0.114f)), _mm256_set1_ps(-128.0f))));
+                if (a == 0)
+                {
+                    lr = _mm256_add_ps(lr, vr);
+                    lg = _mm256_add_ps(lg, vg);
+                    lb = _mm256_add_ps(lb, vb);
+                }
+                else
+                {
+                    hr = _mm256_add_ps(hr, vr);
+                    hg = _mm256_add_ps(hg, vg);
+                    hb = _mm256_add_ps(hb, vb);
+                }
+            }
+        }
+        /* pairwise sums of the 16 columns, hadd works within 128-bit halves */
+        vr = _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(_mm256_hadd_ps(lr, hr)), 0xd8));
+        vg = _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(_mm256_hadd_ps(lg, hg)), 0xd8));
+        vb = _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(_mm256_hadd_ps(lb, hb)), 0xd8));
+        vr = _mm256_mul_ps(vr, scale);
+        vg = _mm256_mul_ps(vg, scale);
+        vb = _mm256_mul_ps(vb, scale);
+        _mm256_storeu_ps(cb + i / 2, _mm256_add_ps(_mm256_sub_ps(
+            _mm256_mul_ps(vb, _mm256_set1_ps(0.5f)),
+            _mm256_mul_ps(vr, _mm256_set1_ps(0.168735892f))),
+            _mm256_mul_ps(vg, _mm256_set1_ps(-0.331264108f))));
+        _mm256_storeu_ps(cr + i / 2, _mm256_add_ps(_mm256_sub_ps(
+            _mm256_mul_ps(vr, _mm256_set1_ps(0.5f)),
+            _mm256_mul_ps(vg, _mm256_set1_ps(0.418687589f))),
+            _mm256_mul_ps(vb, _mm256_set1_ps(-0.081312411f))));
+    }
+    color_convert_subsample(bgr + i * 3, stride, rows, count - i, y0 + i, (rows == 2) ? y1 + i : NULL,
+                            cb + i / 2, cr + i / 2);
+}
+#endif
+
+/* 16-bit fixed-point constants of T.871, the ones of each component add up to 1 or 0 */
+#define FIX16_0_299             ((INT32) 19595)
+#define FIX16_0_587             ((INT32) 38470)
+#define FIX16_0_114             ((INT32)  7471)
+#define FIX16_0_168735892       ((INT32) 11058)
+#define FIX16_0_331264108       ((INT32) 21710)
+#define FIX16_0_5               ((INT32) 32768)
+#define FIX16_0_418687589       ((INT32) 27439)
+#define FIX16_0_081312411       ((INT32)  5329)
+
+void color_init_int(INT32 table[COLOR_TABLE_SIZE])
+{
+    /*
+     * The tables of color_convert_int, one entry per channel
+     * value. The offset of Cb and Cr and the rounding are folded
+     * into one table of each component, so the sum of the entries
+     * of 2^k pixels shifted by COLOR_BITS + k is their rounded
+     * mean just as well.
+     */
+    const INT32 half = (INT32) 1 << (COLOR_BITS - 1), offset = (INT32) 128 << COLOR_BITS;
+    INT32 i;
+
+    for (i = 0; i < 256; i++)
+    {
+        table[R_Y_OFF  + i] =  FIX16_0_299 * i;
+        table[G_Y_OFF  + i] =  FIX16_0_587 * i;
+        table[B_Y_OFF  + i] =  FIX16_0_114 * i + half;
+        table[R_CB_OFF + i] = -FIX16_0_168735892 * i;
+        table[G_CB_OFF + i] = -FIX16_0_331264108 * i;
+        table[B_CB_OFF + i] =  FIX16_0_5 * i + offset + half;   /* also R_CR_OFF */
+        table[G_CR_OFF + i] = -FIX16_0_418687589 * i;
+        table[B_CR_OFF + i] = -FIX16_0_081312411 * i;
+    }
+}
+
+void color_convert_int(const INT32 *table, const BYTE *bgr, int count, INT32 *y, INT32 *cb, INT32 *cr)
+{
+    /*
+     * color_convert without floating point, every sample three
+     * lookups and two adds, rounded to the nearest integer. All
+     * sums are positive, so the shifts are exact.
+     */
+    int i;
+    UINT8 r, g, b;
+
+    for (i = 0; i < count; i++)
+    {
+        b = bgr[i * 3    ];
+        g = bgr[i * 3 + 1];
+        r = bgr[i * 3 + 2];
+        y [i] = ((table[R_Y_OFF  + r] + table[G_Y_OFF  + g] + table[B_Y_OFF  + b]) >> COLOR_BITS) - 128;
+        cb[i] = ((table[R_CB_OFF + r] + table[G_CB_OFF + g] + table[B_CB_OFF + b]) >> COLOR_BITS) - 128;
+        cr[i] = ((table[R_CR_OFF + r] + table[G_CR_OFF + g] + table[B_CR_OFF + b]) >> COLOR_BITS) - 128;
+    }
+}
+
+void color_convert_gray_int(const INT32 *table, const BYTE *bgr, int count, INT32 *y)
+{
+    int i;
+
+    for (i = 0; i < count; i++)
+    {
+        y[i] = ((table[R_Y_OFF + bgr[i * 3 + 2]] + table[G_Y_OFF + bgr[i * 3 + 1]] +
+                 table[B_Y_OFF + bgr[i * 3]]) >> COLOR_BITS) - 128;
+    }
+}
+
+void color_convert_subsample_int(const INT32 *table, const BYTE *bgr, SIZE_T stride, int rows, int count,
+                                 INT32 *y0, INT32 *y1, INT32 *cb, INT32 *cr)
+{
+    /* color_convert_subsample with the tables, the chroma entries of 2 or 4 pixels added up */
+    int i, row, a;
+    INT32 scb, scr, *y;
+    UINT8 r, g, b;
+    const BYTE *p;
+
+    for (i = 0; i + 2 <= count; i += 2)
+    {
+        scb = scr = 0;
+        for (row = 0; row < rows; row++)
+        {
+            y = row ? y1 : y0;
+            p = bgr + row * stride + i * 3;
+            for (a = 0; a < 2; a++)
+            {
+                b = p[a * 3    ];
+                g = p[a * 3 + 1];
+                r = p[a * 3 + 2];
+                y[i + a] = ((table[R_Y_OFF + r] + table[G_Y_OFF + g] + table[B_Y_OFF + b]) >> COLOR_BITS) - 128;
+                scb += table[R_CB_OFF + r] + table[G_CB_OFF + g] + table[B_CB_OFF + b];
+                scr += table[R_CR_OFF + r] + table[G_CR_OFF + g] + table[B_CR_OFF + b];
+            }
+        }
+        cb[i / 2] = (scb >> (COLOR_BITS + rows)) - 128;
+        cr[i / 2] = (scr >> (COLOR_BITS + rows)) - 128;
+    }
+}
+
+void dct_quant_tables(int quality, UINT8 quant_luma[8][8], UINT8 quant_chroma[8][8])
+{
+    int i, j, factor, quant;
+    if (quality <= 0)
+    {
+        factor = 5000;
+    }
+    else if (quality < 50)
+    {
+        factor = 5000 / quality;
+    }
+    else if (quality <= 100)
+    {
+        factor = 200 - quality * 2;
+    }
+    else
+    {
+        factor = 0;
+    }
+    for (j = 0; j < 8; j++)
+    {
+        for (i = 0; i < 8; i++)
+        {
+            quant = (QUANT_LUMA[j][i] * factor + 50) / 100;
+            if (quant <= 0)
+            {
+                quant = 1;
+            }
+            else if (quant > 255)
+            {
+                quant = 255;
+            }
+            quant_luma[j][i] = quant;
+        }
+    }
+    for (j = 0; j < 8; j++)
+    {
+        for (i = 0; i < 8; i++)
+        {
+            quant = (QUANT_CHROMA[j][i] * factor + 50) / 100;
+            if (quant <= 0)
+            {
+                quant = 1;
+            }
+            else if (quant > 255)
+            {
+                quant = 255;
+            }
+            quant_chroma[j][i] = quant;
+        }
+    }
+}
+
+void dct_init(int quality, pJPEG jpeg)
+{
+    int i, j, luma = 255, chroma = 255;
+
+    dct_quant_tables(quality, jpeg->quant_luma, jpeg->quant_chroma);
+    for (j = 0; j < 8; j++)
+    {
+        for (i = 0; i < 8; i++)
+        {
+            if (i + j != 0)
+            {
+                luma = (jpeg->quant_luma[j][i] < luma) ? jpeg->quant_luma[j][i] : luma;
+                chroma = (jpeg->quant_chroma[j][i] < chroma) ? jpeg->quant_chroma[j][i] : chroma;
+            }
+            /* fold the output scaling of the AAN DCT into the quantizers */
+            jpeg->quant_scale[0][j][i] = 1.0 / (AAN_SCALE_FACTOR[j] * AAN_SCALE_FACTOR[i] * 8.0 *
+                                                jpeg->quant_luma[j][i]);
+            jpeg->quant_scale[1][j][i] = 1.0 / (AAN_SCALE_FACTOR[j] * AAN_SCALE_FACTOR[i] * 8.0 *
+                                                jpeg->quant_chroma[j][i]);
+        }
+    }
+
+    /*
+     * No AC coefficient of a block whose samples lie within r of
+     * each other exceeds 4 * r, so with 8 * r <= quant - 1 they
+     * all round to 0 with half a step to spare for the error of
+     * the integer DCT.
+     */
+    jpeg->flat_range[0] = (luma - 1) / 8.0;
+    jpeg->flat_range[1] = (chroma - 1) / 8.0;
+}
+
+void dct_forward(FLOAT matrix[8][8])
+{
+    /*
+     * Reference:   Arai, Y., Agui, T. and Nakajima, M. (1988) A
+     *              Fast DCT-SQ Scheme for Images. Transactions-
+     *              IEICE, E-71, 1095-1097.
+     *
+     * The outputs are left scaled by 8 * s[v] * s[u], this is
+     * undone together with the quantization in dct_quantize.
+     */
     const FLOAT a1 = 0.70710678118654752440;   /*  cos(4pi/16)                 */
     const FLOAT a2 = 0.54119610014619698440;   /*  cos(2pi/16) - cos(6pi/16)   */
     const FLOAT a3 = 0.70710678118654752440;   /*  cos(4pi/16)                 */
     const FLOAT a4 = 1.30656296487637652786;   /*  cos(2pi/16) + cos(6pi/16)   */
     const FLOAT a5 = 0.38268343236508977173;   /*  cos(6pi/16)                 */
 
-    int i, j;
+    int i;
     FLOAT tmp10, tmp11, tmp12, tmp13, tmp14, tmp15, tmp16, tmp17;
     FLOAT tmp20, tmp21, tmp22, tmp23, tmp24, tmp25, tmp26;
     FLOAT tmp32, tmp4_, tmp42, tmp44, tmp45, tmp46, tmp55, tmp57;
@@ -477,472 +1587,4225 @@ void dct_forward(FLOAT matrix[8][8])
         matrix[7][i] =  tmp55 - tmp46;
         matrix[3][i] = -tmp44 + tmp57;
     }
+}
+
+void dct_forward_block(FLOAT blocks[][8][8])
+{
+    /* dct_forward as a kernel of dct_forward_blocks, one block at a time */
+    dct_forward(blocks[0]);
+}
+
+/*
+ * The vector kernels transform as many blocks at once as there
+ * are lanes. Each vector holds the same coefficient of every
+ * block, so both passes of the AAN algorithm run unchanged on
+ * whole vectors, and the transposes only happen on the way in
+ * and out.
+ */
+#ifdef SIMD_SSE2
+#define VFLOAT                  __m128
+#define VADD(a, b)              _mm_add_ps(a, b)
+#define VSUB(a, b)              _mm_sub_ps(a, b)
+#define VMUL(a, b)              _mm_mul_ps(a, b)
+#define VSET1(a)                _mm_set1_ps(a)
+
+SIMD_TARGET("sse2") void dct_forward_pass_sse2(VFLOAT *p, int stride)
+{
+    /*
+     * One 1-D pass of dct_forward over p[0], p[stride], ...,
+     * p[7 * stride], with the same operations in the same order.
+     */
+    const VFLOAT zero = VSET1(0.0f);
+    const VFLOAT a1 = VSET1( 0.70710678118654752440f);
+    const VFLOAT a2 = VSET1(-0.54119610014619698440f);
+    const VFLOAT a3 = VSET1( 0.70710678118654752440f);
+    const VFLOAT a4 = VSET1( 1.30656296487637652786f);
+    const VFLOAT a5 = VSET1( 0.38268343236508977173f);
+
+    VFLOAT tmp10, tmp11, tmp12, tmp13, tmp14, tmp15, tmp16, tmp17;
+    VFLOAT tmp20, tmp21, tmp22, tmp23, tmp24, tmp25, tmp26;
+    VFLOAT tmp32, tmp4_, tmp42, tmp44, tmp45, tmp46, tmp55, tmp57;
+
+    /* stage 1 */
+    tmp10 = VADD(p[7 * stride], p[0 * stride]);
+    tmp11 = VADD(p[6 * stride], p[1 * stride]);
+    tmp12 = VADD(p[5 * stride], p[2 * stride]);
+    tmp13 = VADD(p[4 * stride], p[3 * stride]);
+    tmp14 = VSUB(p[3 * stride], p[4 * stride]);
+    tmp15 = VSUB(p[2 * stride], p[5 * stride]);
+    tmp16 = VSUB(p[1 * stride], p[6 * stride]);
+    tmp17 = VSUB(p[0 * stride], p[7 * stride]);
+
+    /* stage 2 */
+    tmp20 = VADD(tmp13, tmp10);
+    tmp21 = VADD(tmp12, tmp11);
+    tmp22 = VSUB(tmp11, tmp12);
+    tmp23 = VSUB(tmp10, tmp13);
+    tmp24 = VSUB(VSUB(zero, tmp15), tmp14);
+    tmp25 = VADD(tmp16, tmp15);
+    tmp26 = VADD(tmp17, tmp16);
+
+    /* stage 3 */
+    p[0 * stride] = VADD(tmp21, tmp20);
+    p[4 * stride] = VSUB(tmp20, tmp21);
+    tmp32         = VADD(tmp23, tmp22);
+
+    /* stage 4 */
+    tmp4_ = VMUL(a5, VADD(tmp24, tmp26));
+    tmp42 = VMUL(a1, tmp32);
+    tmp44 = VSUB(VMUL(a2, tmp24), tmp4_);
+    tmp45 = VMUL(a3, tmp25);
+    tmp46 = VSUB(VMUL(a4, tmp26), tmp4_);
+
+    /* stage 5 */
+    p[2 * stride] = VADD(tmp23, tmp42);
+    p[6 * stride] = VSUB(tmp23, tmp42);
+    tmp55         = VADD(tmp17, tmp45);
+    tmp57         = VSUB(tmp17, tmp45);
+
+    /* stage 6 */
+    p[5 * stride] = VADD(tmp57, tmp44);
+    p[1 * stride] = VADD(tmp46, tmp55);
+    p[7 * stride] = VSUB(tmp55, tmp46);
+    p[3 * stride] = VSUB(tmp57, tmp44);
+}
+
+SIMD_TARGET("sse2") void dct_forward_lanes_sse2(FLOAT blocks[][8][8])
+{
+    /* four blocks, four by four transposes */
+    VFLOAT v[8][8];
+    VFLOAT r[4];
+    int i, j, k;
 
-    /* scaling */
     for (i = 0; i < 8; i++)
     {
-        for (j = 0; j < 8; j++)
+        for (j = 0; j < 8; j += 4)
         {
-            matrix[i][j] /= AAN_SCALE_FACTOR[i] * AAN_SCALE_FACTOR[j] * 8.0;
+            for (k = 0; k < 4; k++)
+            {
+                r[k] = _mm_loadu_ps(&blocks[k][i][j]);
+            }
+            _MM_TRANSPOSE4_PS(r[0], r[1], r[2], r[3]);
+            for (k = 0; k < 4; k++)
+            {
+                v[i][j + k] = r[k];
+            }
         }
     }
-}
 
-void dct_quantize(FLOAT matrix[8][8], int comp, pJPEG jpeg)
-{
-    int x, y, divisor;
+    /* rows */
+    for (i = 0; i < 8; i++)
+    {
+        dct_forward_pass_sse2(&v[i][0], 1);
+    }
 
-    for (y = 0; y < 8; y++)
+    /* columns */
+    for (i = 0; i < 8; i++)
     {
-        for (x = 0; x < 8; x++)
+        dct_forward_pass_sse2(&v[0][i], 8);
+    }
+
+    for (i = 0; i < 8; i++)
+    {
+        for (j = 0; j < 8; j += 4)
         {
-            divisor = comp == 0 ? jpeg->quant_luma[y][x]: jpeg->quant_chroma[y][x];
-            matrix[y][x] = (int)(matrix[y][x] / divisor + 0x4000 + 0.5) - 0x4000;
+            for (k = 0; k < 4; k++)
+            {
+                r[k] = v[i][j + k];
+            }
+            _MM_TRANSPOSE4_PS(r[0], r[1], r[2], r[3]);
+            for (k = 0; k < 4; k++)
+            {
+                _mm_storeu_ps(&blocks[k][i][j], r[k]);
+            }
         }
     }
 }
 
-void huffman_init(pJPEG jpeg)
+#undef VFLOAT
+#undef VADD
+#undef VSUB
+#undef VMUL
+#undef VSET1
+#endif
+
+#ifdef SIMD_AVX2
+#define VFLOAT                  __m256
+#define VADD(a, b)              _mm256_add_ps(a, b)
+#define VSUB(a, b)              _mm256_sub_ps(a, b)
+#define VMUL(a, b)              _mm256_mul_ps(a, b)
+#define VSET1(a)                _mm256_set1_ps(a)
+
+SIMD_TARGET("avx2") void dct_forward_pass_avx2(VFLOAT *p, int stride)
 {
-    int h, i, index, temp;
-    int val, nbits, count;
+    /* dct_forward_pass_sse2 on eight lanes */
+    const VFLOAT zero = VSET1(0.0f);
+    const VFLOAT a1 = VSET1( 0.70710678118654752440f);
+    const VFLOAT a2 = VSET1(-0.54119610014619698440f);
+    const VFLOAT a3 = VSET1( 0.70710678118654752440f);
+    const VFLOAT a4 = VSET1( 1.30656296487637652786f);
+    const VFLOAT a5 = VSET1( 0.38268343236508977173f);
 
-    /* Huffman */
-    HUFFMAN *huff;
-    UINT8  code_nbits[256];
-    BITCODE *huff_table, *pcode;
+    VFLOAT tmp10, tmp11, tmp12, tmp13, tmp14, tmp15, tmp16, tmp17;
+    VFLOAT tmp20, tmp21, tmp22, tmp23, tmp24, tmp25, tmp26;
+    VFLOAT tmp32, tmp4_, tmp42, tmp44, tmp45, tmp46, tmp55, tmp57;
 
-    for (h = 0; h < 4; h++)
-    {
-        huff = &HUFF[h];
-        huff_table = jpeg->huff_table[h];
+    /* stage 1 */
+    tmp10 = VADD(p[7 * stride], p[0 * stride]);
+    tmp11 = VADD(p[6 * stride], p[1 * stride]);
+    tmp12 = VADD(p[5 * stride], p[2 * stride]);
+    tmp13 = VADD(p[4 * stride], p[3 * stride]);
+    tmp14 = VSUB(p[3 * stride], p[4 * stride]);
+    tmp15 = VSUB(p[2 * stride], p[5 * stride]);
+    tmp16 = VSUB(p[1 * stride], p[6 * stride]);
+    tmp17 = VSUB(p[0 * stride], p[7 * stride]);
 
-        index = 0;
-        for (nbits = 1; nbits <= 16; nbits++)
-        {
-            for (i = 0; i < huff->bits[nbits-1]; i++)
-            {
-                code_nbits[index++] = nbits;
-            }
-        }
-        count = index;
+    /* stage 2 */
+    tmp20 = VADD(tmp13, tmp10);
+    tmp21 = VADD(tmp12, tmp11);
+    tmp22 = VSUB(tmp11, tmp12);
+    tmp23 = VSUB(tmp10, tmp13);
+    tmp24 = VSUB(VSUB(zero, tmp15), tmp14);
+    tmp25 = VADD(tmp16, tmp15);
+    tmp26 = VADD(tmp17, tmp16);
 
-        val = 0;
-        index = 0;
-        nbits = code_nbits[0];
-        while (index < count)
-        {
-            while (code_nbits[index] == nbits)
-            {
-                pcode = &(huff_table[huff->huffval[index]]);
-                pcode->value = val;
-                pcode->nbits = nbits;
-                val++;
-                index++;
-            }
-            val <<= 1;
-            nbits++;
-        }
-    }
+    /* stage 3 */
+    p[0 * stride] = VADD(tmp21, tmp20);
+    p[4 * stride] = VSUB(tmp20, tmp21);
+    tmp32         = VADD(tmp23, tmp22);
 
-    /* VLI */
-    for (i = -2048; i < 2048; i++)
-    {
-        index = i & 0xFFF;
-        temp = val = i;
-        if (temp < 0)
-        {
-            temp = -temp;       /* temp should be positive */
-            val--;
-        }
-        nbits = 0;
-        while (temp != 0)
-        {
-            nbits++;
-            temp >>= 1;
-        }
-        val &= ~(-1 << nbits);
-        jpeg->vli_table[index].value = val;
-        jpeg->vli_table[index].nbits = nbits;
-    }
+    /* stage 4 */
+    tmp4_ = VMUL(a5, VADD(tmp24, tmp26));
+    tmp42 = VMUL(a1, tmp32);
+    tmp44 = VSUB(VMUL(a2, tmp24), tmp4_);
+    tmp45 = VMUL(a3, tmp25);
+    tmp46 = VSUB(VMUL(a4, tmp26), tmp4_);
+
+    /* stage 5 */
+    p[2 * stride] = VADD(tmp23, tmp42);
+    p[6 * stride] = VSUB(tmp23, tmp42);
+    tmp55         = VADD(tmp17, tmp45);
+    tmp57         = VSUB(tmp17, tmp45);
+
+    /* stage 6 */
+    p[5 * stride] = VADD(tmp57, tmp44);
+    p[1 * stride] = VADD(tmp46, tmp55);
+    p[7 * stride] = VSUB(tmp55, tmp46);
+    p[3 * stride] = VSUB(tmp57, tmp44);
 }
 
-void huffman_putcode(BITCODE bitcode, pJPEG jpeg)
+SIMD_TARGET("avx2") void dct_transpose_avx2(VFLOAT r[8])
+{
+    /* 8x8 transpose in registers */
+    __m256 t0, t1, t2, t3, t4, t5, t6, t7;
+
+    t0 = _mm256_unpacklo_ps(r[0], r[1]);
+    t1 = _mm256_unpackhi_ps(r[0], r[1]);
+    t2 = _mm256_unpacklo_ps(r[2], r[3]);
+    t3 = _mm256_unpackhi_ps(r[2], r[3]);
+    t4 = _mm256_unpacklo_ps(r[4], r[5]);
+    t5 = _mm256_unpackhi_ps(r[4], r[5]);
+    t6 = _mm256_unpacklo_ps(r[6], r[7]);
+    t7 = _mm256_unpackhi_ps(r[6], r[7]);
+    r[0] = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(1, 0, 1, 0));
+    r[1] = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(3, 2, 3, 2));
+    r[2] = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(1, 0, 1, 0));
+    r[3] = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(3, 2, 3, 2));
+    r[4] = _mm256_shuffle_ps(t4, t6, _MM_SHUFFLE(1, 0, 1, 0));
+    r[5] = _mm256_shuffle_ps(t4, t6, _MM_SHUFFLE(3, 2, 3, 2));
+    r[6] = _mm256_shuffle_ps(t5, t7, _MM_SHUFFLE(1, 0, 1, 0));
+    r[7] = _mm256_shuffle_ps(t5, t7, _MM_SHUFFLE(3, 2, 3, 2));
+    t0 = _mm256_permute2f128_ps(r[0], r[4], 0x20);
+    t1 = _mm256_permute2f128_ps(r[1], r[5], 0x20);
+    t2 = _mm256_permute2f128_ps(r[2], r[6], 0x20);
+    t3 = _mm256_permute2f128_ps(r[3], r[7], 0x20);
+    t4 = _mm256_permute2f128_ps(r[0], r[4], 0x31);
+    t5 = _mm256_permute2f128_ps(r[1], r[5], 0x31);
+    t6 = _mm256_permute2f128_ps(r[2], r[6], 0x31);
+    t7 = _mm256_permute2f128_ps(r[3], r[7], 0x31);
+    r[0] = t0; r[1] = t1; r[2] = t2; r[3] = t3;
+    r[4] = t4; r[5] = t5; r[6] = t6; r[7] = t7;
+}
+
+SIMD_TARGET("avx2") void dct_forward_lanes_avx2(FLOAT blocks[][8][8])
 {
-    UINT16 value = bitcode.value;
-    UINT8 length = bitcode.nbits;
-    UINT8 shift, fragment;
+    /* eight blocks, one eight by eight transpose each way */
+    VFLOAT v[8][8];
+    int i, k;
 
-    /* extend the output buffer */
-    if (jpeg->capacity - jpeg->size < 4)
+    for (i = 0; i < 8; i++)
     {
-        if ((jpeg->data = realloc(jpeg->data, jpeg->capacity * 2)) == NULL)
+        for (k = 0; k < 8; k++)
         {
-            error_exit(OUT_OF_MEMORY_ERROR);
+            v[i][k] = _mm256_loadu_ps(&blocks[k][i][0]);
         }
-        jpeg->capacity *= 2;
+        dct_transpose_avx2(v[i]);
     }
 
-    while (jpeg->_nvacant < length)
+    /* rows */
+    for (i = 0; i < 8; i++)
     {
-        shift = length - jpeg->_nvacant;            /* bits remaining */
-        fragment = value >> shift;
-        jpeg->_buff <<= (jpeg->_nvacant);
-        jpeg->_buff |= fragment;                    /* (jpeg->_nvacant = 0) */
-
-        jpeg->data[(jpeg->size)++] = jpeg->_buff;   /* buffer is full, write and reset */
-        if (jpeg->_buff == 0xff)
-        {
-            jpeg->data[(jpeg->size)++] = 0;         /* byte stuffing (T.81 P.91 F.1.2.3) */
-        }
-        jpeg->_buff = 0;
-        jpeg->_nvacant = 8;
-
-        value = value & ~(~0 << shift);             /* truncate written highs */
-        length = shift;                             /* bits left to write */
+        dct_forward_pass_avx2(&v[i][0], 1);
     }
 
-    /* buffer sufficient */
-    jpeg->_buff <<= length;
-    jpeg->_buff |= value;
-    jpeg->_nvacant -= length;
-}
-
-void huffman_finish(pJPEG jpeg)
-{
-    if (jpeg->_nvacant != 0)                        /* buffer is not full, then left shift, pad with zero */
+    /* columns */
+    for (i = 0; i < 8; i++)
     {
-        jpeg->_buff <<= (jpeg->_nvacant);
+        dct_forward_pass_avx2(&v[0][i], 8);
     }
-    if (jpeg->_nvacant != 8)                        /* buffer is not empty, then write to stream */
+
+    for (i = 0; i < 8; i++)
     {
-        jpeg->data[(jpeg->size)++] = jpeg->_buff;
-        if (jpeg->_buff == 0xff)
+        dct_transpose_avx2(v[i]);
+        for (k = 0; k < 8; k++)
         {
-            jpeg->data[(jpeg->size)++] = 0;         /* byte stuffing (T.81 P.91 F.1.2.3) */
+            _mm256_storeu_ps(&blocks[k][i][0], v[i][k]);
         }
     }
-    jpeg->_buff = 0;
-    jpeg->_nvacant = 8;
 }
 
-void huffman_encode(FLOAT matrix[8][8], int comp, int prev_dc, pJPEG jpeg)
+#undef VFLOAT
+#undef VADD
+#undef VSUB
+#undef VMUL
+#undef VSET1
+#endif
+
+void dct_forward_blocks(const KERNELS *kernels, FLOAT blocks[][8][8], int count)
 {
-    BITCODE vli_code, huff_code;
-    BITCODE *dc_table, *ac_table;
-    int dc_diff, ac_value;
-    int x, y, k, r;
+    /*
+     * Forward DCT of count blocks, kernels->lanes at a time, so
+     * blocks must have room for count rounded up to a multiple
+     * of the lanes; the extra blocks are cleared and overwritten.
+     */
+    int n;
 
-    if (comp == 0)  /* Luma */
+    for (n = count; n % kernels->lanes != 0; n++)
     {
-        dc_table = jpeg->huff_table[0];
-        ac_table = jpeg->huff_table[1];
+        memset(blocks[n], 0, sizeof(blocks[n]));
     }
-    else            /* Chroma */
+    for (n = 0; n < count; n += kernels->lanes)
     {
-        dc_table = jpeg->huff_table[2];
-        ac_table = jpeg->huff_table[3];
+        kernels->dct(blocks + n);
     }
+}
 
-    /*
-     * DC coefficient
-     */
-    dc_diff = (int) matrix[0][0] - prev_dc;
-
-    vli_code = jpeg->vli_table[dc_diff & 0xfff];
-    huff_code = dc_table[vli_code.nbits];
+void dct_zigzag(int natural[8][8], pBLOCK block)
+{
+    /* reorder the coefficients and note which of them are nonzero */
+    const int *in = natural[0];
+    int k;
 
-    huffman_putcode(huff_code, jpeg);
-    if (vli_code.nbits != 0)
+    block->nonzero[0] = block->nonzero[1] = 0;
+    for (k = 0; k < 64; k++)
     {
-        huffman_putcode(vli_code, jpeg);
+        block->coef[k] = in[JPEG_NATURAL_ORDER[k]];
+        block->nonzero[k >> 5] |= (UINT32) (block->coef[k] != 0) << (k & 31);
     }
+}
 
-    /*
-     * AC coefficients
-     */
-    r = 0;
-    for (k = 1; k < 64; k++)
+void dct_scale(FLOAT matrix[8][8], FLOAT scale[8][8], int natural[8][8])
+{
+    /* the products of dct_quantize rounded half up */
+    int x, y;
+
+    for (y = 0; y < 8; y++)
     {
-        x = JPEG_NATURAL_ORDER[k] % 8;
-        y = JPEG_NATURAL_ORDER[k] / 8;
-        ac_value = (int) matrix[y][x];
-        if (ac_value == 0)
-        {
-            r++;
-        }
-        else
+        for (x = 0; x < 8; x++)
         {
-            while (r > 15)
-            {
-                /* ZRL */
-                huff_code = ac_table[0xf0];
-                huffman_putcode(huff_code, jpeg);
-                r -= 16;
-            }
-            vli_code = jpeg->vli_table[ac_value & 0xfff];
-            huff_code = ac_table[(r << 4) | vli_code.nbits];
-            huffman_putcode(huff_code, jpeg);
-            huffman_putcode(vli_code, jpeg);
-            r = 0;
+            natural[y][x] = (int)(matrix[y][x] * scale[y][x] + 0x4000 + 0.5) - 0x4000;
         }
     }
-    if (r > 0)
-    {
-        /* EOB */
-        huff_code = ac_table[0x00];
-        huffman_putcode(huff_code, jpeg);
-    }
 }
 
-void jpeg_put_header(pBITMAP bitmap, pJPEG jpeg)
+#ifdef SIMD_SSE2
+SIMD_TARGET("sse2") void dct_scale_sse2(FLOAT matrix[8][8], FLOAT scale[8][8], int natural[8][8])
 {
-    HUFFMAN *huff;
-    SIZE_T temp01, temp02;
-    int i, j, k;
-    const int comp_id[3]        = {1, 2, 3};
-    const int h_samp_factor[3]  = {2, 1, 1};
-    const int v_samp_factor[3]  = {2, 1, 1};
-    const int quant_table_id[3] = {0, 1, 1};
-    const int dc_table_id[3]    = {0, 1, 1};
-    const int ac_table_id[3]    = {0, 1, 1};
-
-    /*
-     * Start of Image Marker
-     */
-    jpeg->data[jpeg->size++] = 0xff;
-    jpeg->data[jpeg->size++] = 0xd8;
-
-    /*
-     * Start of Frame Header (T.81 P.36)
-     */
-    jpeg->data[jpeg->size++] = 0xff;                                        /* SOF0 marker - 0xFFC0 */
-    jpeg->data[jpeg->size++] = 0xc0;
-    jpeg->data[jpeg->size++] = 0x00;                                        /* Length of segment excluding SOF0 marker */
-    jpeg->data[jpeg->size++] = 0x11;
-    jpeg->data[jpeg->size++] = 0x08;                                        /* Sample precision */
-    jpeg->data[jpeg->size++] = (jpeg->height >> 8 & 0xff);                  /* Number of lines */
-    jpeg->data[jpeg->size++] = (jpeg->height      & 0xff);
-    jpeg->data[jpeg->size++] = (jpeg->width  >> 8 & 0xff);                  /* Number of samples per line */
-    jpeg->data[jpeg->size++] = (jpeg->width       & 0xff);
-    jpeg->data[jpeg->size++] = 0x03;                                        /* Number of image components in frame */
+    int y;
 
-    for (i = 0; i < 3; i++)
+    for (y = 0; y < 8; y++)
     {
-        jpeg->data[jpeg->size++] = comp_id[i];                              /* Component identifier */
-        jpeg->data[jpeg->size++] = (( h_samp_factor[i] << 4 )|              /* Horizontal sampling factor */
-                                      v_samp_factor[i]       );             /* Vertical sampling factor */
-        jpeg->data[jpeg->size++] = quant_table_id[i];                       /* Quantization table destination selector */
+        _mm_storeu_si128((__m128i *) natural[y], _mm_cvtps_epi32(
+            _mm_mul_ps(_mm_loadu_ps(matrix[y]), _mm_loadu_ps(scale[y]))));
+        _mm_storeu_si128((__m128i *) (natural[y] + 4), _mm_cvtps_epi32(
+            _mm_mul_ps(_mm_loadu_ps(matrix[y] + 4), _mm_loadu_ps(scale[y] + 4))));
     }
+}
+#endif
 
-    /*
-     * Define Quantization Table header (T.81 P.39)
-     */
-    jpeg->data[jpeg->size++] = 0xff;                                        /* DQT marker - 0xFFDB */
-    jpeg->data[jpeg->size++] = 0xdb;
-    jpeg->data[jpeg->size++] = 0x00;                                        /* Length of segment excluding DQT marker */
-    jpeg->data[jpeg->size++] = 0x84;
-    for (i = 0; i < 2; i++)
-    {
-        jpeg->data[jpeg->size++] = (( 0 << 4 )|                             /* Quantization table element precision */
-                                      i       );                            /* Quantization table destination identifier */
-        for (j = 0; j < 64; j++)
-        {
-            k = JPEG_NATURAL_ORDER[j];
-            jpeg->data[jpeg->size++] = (i == 0) ?
-                                       jpeg->quant_luma  [k / 8][k % 8] :
-                                       jpeg->quant_chroma[k / 8][k % 8];
-        }
-    }
+#ifdef SIMD_AVX2
+SIMD_TARGET("avx2") void dct_scale_avx2(FLOAT matrix[8][8], FLOAT scale[8][8], int natural[8][8])
+{
+    int y;
 
-    /*
-     * Define Huffman Table Header (T.81 P.40)
-     */
-    jpeg->data[jpeg->size++] = 0xff;                                        /* DHT marker - 0xFFC4 */
-    jpeg->data[jpeg->size++] = 0xc4;
-    temp01 = jpeg->size++;                                                  /* (position of length) */
-    temp02 = jpeg->size++;
-    for (i = 0; i < 4; i++)
+    for (y = 0; y < 8; y++)
     {
-        huff = &HUFF[i];
-        jpeg->data[jpeg->size++] = huff->id;                                /* Table class & Huffman table destination id */
-        k = 0;
-        for (j = 0; j < 16; j++)
-        {
-            k += (jpeg->data[jpeg->size++] = huff->bits[j]);                /* Number of Huffman codes of length i */
-        }
-        for (j = 0; j < k; j++)
-        {
-            jpeg->data[jpeg->size++] = huff->huffval[j];                    /* Value associated with each Huffman code */
-        }
+        _mm256_storeu_si256((__m256i *) natural[y], _mm256_cvtps_epi32(
+            _mm256_mul_ps(_mm256_loadu_ps(matrix[y]), _mm256_loadu_ps(scale[y]))));
     }
-    k = (int) (jpeg->size - temp01);
-    jpeg->data[temp01] = (k >> 8) & 0xff;                                   /* Length of segment excluding DHT marker */
-    jpeg->data[temp02] = (k     ) & 0xff;
+}
+#endif
 
+void dct_quantize(FLOAT matrix[8][8], int comp, pJPEG jpeg, pBLOCK block)
+{
     /*
-     * Start of Scan Header (T.81 P.37)
+     * One multiply per coefficient by the reciprocal of the
+     * quantizer, which also carries the scaling of dct_forward.
+     * The vector kernels round half to even instead of half
+     * up, which only matters for exact ties.
      */
-    jpeg->data[jpeg->size++] = 0xff;                                        /* SOS marker - 0xFFDA */
-    jpeg->data[jpeg->size++] = 0xda;
-    jpeg->data[jpeg->size++] = 0x00;                                        /* Length of segment excluding SOS marker */
-    jpeg->data[jpeg->size++] = 0x0c;
-    jpeg->data[jpeg->size++] = 0x03;                                        /* Number of image components in scan */
-    for (i = 0; i < 3; i++)
+    int natural[8][8];
+
+    jpeg->kernels->scale(matrix, jpeg->quant_scale[comp == 0 ? 0 : 1], natural);
+    dct_zigzag(natural, block);
+}
+
+#define FLAT_FAR(a, b, range)   ((a) - (b) > (range) || (b) - (a) > (range))
+
+FLOAT dct_spread(FLOAT matrix[8][8])
+{
+    /* the largest sample minus the smallest one */
+    const FLOAT *p = matrix[0];
+    FLOAT lo = p[0], hi = p[0];
+    int i;
+
+    for (i = 1; i < 64; i++)
     {
-        jpeg->data[jpeg->size++] = comp_id[i];
-        jpeg->data[jpeg->size++] = (( dc_table_id[i] << 4 )|                /* DC entropy coding table destination selector */
-                                      ac_table_id[i]       );               /* AC entropy coding table destination selector */
+        lo = (p[i] < lo) ? p[i] : lo;
+        hi = (p[i] > hi) ? p[i] : hi;
     }
-    jpeg->data[jpeg->size++] = 0x00;                                        /* Start of spectral or predictor selection */
-    jpeg->data[jpeg->size++] = 0x3f;                                        /* End of spectral selection */
-    jpeg->data[jpeg->size++] = 0x00;                                        /* Successive approximation bit position high & low */
+    return hi - lo;
 }
 
-void jpeg_put_eoi(pJPEG jpeg)
+#ifdef SIMD_SSE2
+SIMD_TARGET("sse2") FLOAT dct_spread_sse2(FLOAT matrix[8][8])
 {
-    /*
-     * End of Image Marker
-     */
-    jpeg->data[jpeg->size++] = 0xff;                                        /* EOI marker - 0xFFD9 */
-    jpeg->data[jpeg->size++] = 0xd9;
+    __m128 lo, hi, v;
+    int i;
+
+    lo = _mm_min_ps(_mm_loadu_ps(matrix[0]), _mm_loadu_ps(matrix[0] + 4));
+    hi = _mm_max_ps(_mm_loadu_ps(matrix[0]), _mm_loadu_ps(matrix[0] + 4));
+    for (i = 1; i < 8; i++)
+    {
+        v = _mm_loadu_ps(matrix[i]);
+        lo = _mm_min_ps(lo, v);
+        hi = _mm_max_ps(hi, v);
+        v = _mm_loadu_ps(matrix[i] + 4);
+        lo = _mm_min_ps(lo, v);
+        hi = _mm_max_ps(hi, v);
+    }
+    lo = _mm_min_ps(lo, _mm_shuffle_ps(lo, lo, 0x4e));
+    hi = _mm_max_ps(hi, _mm_shuffle_ps(hi, hi, 0x4e));
+    lo = _mm_min_ps(lo, _mm_shuffle_ps(lo, lo, 0xb1));
+    hi = _mm_max_ps(hi, _mm_shuffle_ps(hi, hi, 0xb1));
+    return _mm_cvtss_f32(hi) - _mm_cvtss_f32(lo);
 }
+#endif
 
-pJPEG jpeg_create_from_bmp(pBITMAP bitmap, int quality)
+#ifdef SIMD_AVX2
+SIMD_TARGET("avx2") FLOAT dct_spread_avx2(FLOAT matrix[8][8])
 {
-    pJPEG jpeg;
-    RGB pixel_rgb;
-    FLOAT block_matrix[8][8];
-    UINT32 x_unit_count, y_unit_count, x_unit, y_unit;
-    UINT32 x_base, y_base, x_pos, y_pos;
-    int comp, a, b, x_factor, y_factor, x_block, y_block;
-    int prev_dc[3] = { 0 };
-
-    /* 4:2:0 chroma subsampling */
-    int h_samp_factor[3] = {2, 1, 1};
-    int v_samp_factor[3] = {2, 1, 1};
-    int x_factor_max = 2, y_factor_max = 2;
+    __m256 lo, hi, v;
+    int i;
 
-    if ((jpeg = malloc(sizeof(JPEG))) == NULL)
+    lo = hi = _mm256_loadu_ps(matrix[0]);
+    for (i = 1; i < 8; i++)
     {
-        error_exit(OUT_OF_MEMORY_ERROR);
+        v = _mm256_loadu_ps(matrix[i]);
+        lo = _mm256_min_ps(lo, v);
+        hi = _mm256_max_ps(hi, v);
     }
-    jpeg->width = labs(bitmap->width);
-    jpeg->height = labs(bitmap->height);
-    jpeg->size = 0;
-    jpeg->_buff = 0;
-    jpeg->_nvacant = 8;
+    lo = _mm256_min_ps(lo, _mm256_permute2f128_ps(lo, lo, 1));
+    hi = _mm256_max_ps(hi, _mm256_permute2f128_ps(hi, hi, 1));
+    lo = _mm256_min_ps(lo, _mm256_shuffle_ps(lo, lo, 0x4e));
+    hi = _mm256_max_ps(hi, _mm256_shuffle_ps(hi, hi, 0x4e));
+    lo = _mm256_min_ps(lo, _mm256_shuffle_ps(lo, lo, 0xb1));
+    hi = _mm256_max_ps(hi, _mm256_shuffle_ps(hi, hi, 0xb1));
+    return _mm256_cvtss_f32(hi) - _mm256_cvtss_f32(lo);
+}
+#endif
 
+int dct_flat(const KERNELS *kernels, FLOAT matrix[8][8], FLOAT range, FLOAT *dc)
+{
     /*
-     * 1024 is enough to hold the header, and we estimate
-     * the resulting jpeg size to be width * height / 4.
-     * If it's not enough, the buffer will be expanded in
-     * the future.
+     * Whether the samples lie within range of each other. If so,
+     * dc is what dct_forward would leave in matrix[0][0], added
+     * up in the same order so that it is the same to the bit.
      */
-    jpeg->capacity = 1024 + jpeg->width * jpeg->height / 4;
+    FLOAT row[8];
+    int i;
 
-    if ((jpeg->data = malloc(jpeg->capacity)) == NULL)
+    /* most blocks of a photo already fail on a few samples */
+    if (FLAT_FAR(matrix[0][0], matrix[7][7], range) || FLAT_FAR(matrix[0][7], matrix[7][0], range) ||
+        FLAT_FAR(matrix[0][0], matrix[3][4], range) || kernels->spread(matrix) > range)
     {
-        error_exit(OUT_OF_MEMORY_ERROR);
+        return 0;
     }
 
-    huffman_init(jpeg);
-    dct_init(quality, jpeg);
-    jpeg_put_header(bitmap, jpeg);
-
-    x_unit_count = (7 + jpeg->width  / x_factor_max) >> 3;
-    y_unit_count = (7 + jpeg->height / y_factor_max) >> 3;
-    /* Minimum Coded Units */
-    for (y_unit = 0; y_unit < y_unit_count; y_unit++)
+    for (i = 0; i < 8; i++)
     {
-        for (x_unit = 0; x_unit < x_unit_count; x_unit++)
-        {
-            x_base = x_unit * 8 * x_factor_max;
-            y_base = y_unit * 8 * y_factor_max;
-            /* Components */
-            for (comp = 0; comp < 3; comp++)
-            {
-                x_factor = h_samp_factor[comp];
-                y_factor = v_samp_factor[comp];
-                /* DCT Blocks */
-                for (y_block = 0; y_block < y_factor; y_block++)
-                {
-                    for (x_block = 0; x_block < x_factor; x_block++)
-                    {
-                        /* Pixels */
-                        for (b = 0; b < 8; b++)
-                        {
-                            for (a = 0; a < 8; a++)
-                            {
-                                x_pos = x_base + a * x_factor_max / x_factor + x_block * 8;
-                                y_pos = y_base + b * y_factor_max / y_factor + y_block * 8;
-                                pixel_rgb = bitmap_get_rgb(bitmap, x_pos, y_pos);
-                                block_matrix[b][a] = rgb_to_ycc(pixel_rgb, comp) - 128.0;
-                            }
-                        }
-                        dct_forward(block_matrix);
-                        dct_quantize(block_matrix, comp, jpeg);
-                        huffman_encode(block_matrix, comp, prev_dc[comp], jpeg);
-
-                        prev_dc[comp] = (int) block_matrix[0][0];
-                    }
-                }
-            }
-        }
+        row[i] = ((matrix[i][4] + matrix[i][3]) + (matrix[i][7] + matrix[i][0])) +
+                 ((matrix[i][5] + matrix[i][2]) + (matrix[i][6] + matrix[i][1]));
     }
-    huffman_finish(jpeg);
-    jpeg_put_eoi(jpeg);
-    return jpeg;
+    *dc = ((row[5] + row[2]) + (row[6] + row[1])) + ((row[4] + row[3]) + (row[7] + row[0]));
+    return 1;
 }
 
-void jpeg_save(pJPEG jpeg, FILE* fp)
+int dct_round(FLOAT value)
 {
-    fwrite(jpeg->data, 1, jpeg->size, fp);
+    /* one product of dct_scale */
+    return (int)(value + 0x4000 + 0.5) - 0x4000;
 }
 
-void jpeg_free(pJPEG jpeg)
+#ifdef SIMD_SSE2
+SIMD_TARGET("sse2") int dct_round_sse2(FLOAT value)
 {
-    free(jpeg->data);
-    free(jpeg);
+    /* one product of the vector dct_scale kernels, half to even */
+    return _mm_cvtss_si32(_mm_set_ss(value));
 }
+#endif
 
-int main(int argc, char *argv[])
+void dct_quantize_dc(FLOAT dc, int comp, pJPEG jpeg, pBLOCK block)
 {
-    int quality = 75;
-    char *ptr;
-    FILE *in_file, *out_file;
+    /* a block of dct_flat, rounded like dct_quantize; only coef[0] and the nonzero bits are set */
+    block->coef[0] = jpeg->kernels->round(dc * jpeg->quant_scale[comp == 0 ? 0 : 1][0][0]);
+    block->nonzero[0] = (block->coef[0] != 0);
+    block->nonzero[1] = 0;
+}
 
-    pBITMAP bitmap;
-    pJPEG jpeg;
+/* 13-bit fixed-point constants, FIX(x) = (INT32) (x * 8192 + 0.5) */
+#define FIX_0_298631336         ((INT32)  2446)
+#define FIX_0_390180644         ((INT32)  3196)
+#define FIX_0_541196100         ((INT32)  4433)
+#define FIX_0_765366865         ((INT32)  6270)
+#define FIX_0_899976223         ((INT32)  7373)
+#define FIX_1_175875602         ((INT32)  9633)
+#define FIX_1_501321110         ((INT32) 12299)
+#define FIX_1_847759065         ((INT32) 15137)
+#define FIX_1_961570560         ((INT32) 16069)
+#define FIX_2_053119869         ((INT32) 16819)
+#define FIX_2_562915447         ((INT32) 20995)
+#define FIX_3_072711026         ((INT32) 25172)
+#define CONST_BITS              13
+#define PASS1_BITS              2
+#define DESCALE(x, n)           (((x) + ((INT32) 1 << ((n) - 1))) >> (n))
+#define LEFT_SHIFT(x, n)        ((x) * ((INT32) 1 << (n)))     /* x may be negative */
 
-    if (argc < 3)
-    {
-        fprintf(stderr, "Usage: %s INPUT.bmp OUTPUT.jpg [quality]\n", argv[0]);
-        return EXIT_FAILURE;
-    }
-    else if (argc > 3)
+void dct_forward_int(INT32 matrix[8][8])
+{
+    /*
+     * Reference:   Loeffler, C., Ligtenberg, A. and Moschytz, G.
+     *              (1989) Practical Fast 1-D DCT Algorithms with
+     *              11 Multiplications. Proc. ICASSP 1989, 988-991.
+     *
+     * The row pass keeps PASS1_BITS of extra precision, which
+     * the column pass removes again. The outputs are scaled up
+     * by 8, this is undone in dct_quantize_int.
+     */
+    int i;
+    INT32 tmp0, tmp1, tmp2, tmp3, tmp4, tmp5, tmp6, tmp7;
+    INT32 tmp10, tmp11, tmp12, tmp13;
+    INT32 z1, z2, z3, z4, z5;
+
+    /* rows */
+    for (i = 0; i < 8; i++)
     {
-        quality = (int) strtol(argv[3], &ptr, 10);
-        if (*ptr != '\0' || quality < 0 || quality > 100)
-        {
-            fprintf(stderr, "The value of quality should be between 0 and 100.\n\n"
-                            "Usage: %s INPUT.bmp OUTPUT.jpg [quality]\n", argv[0]);
-            return EXIT_FAILURE;
-        }
-    }
+        /* even part */
+        tmp0 = matrix[i][0] + matrix[i][7];
+        tmp7 = matrix[i][0] - matrix[i][7];
+        tmp1 = matrix[i][1] + matrix[i][6];
+        tmp6 = matrix[i][1] - matrix[i][6];
+        tmp2 = matrix[i][2] + matrix[i][5];
+        tmp5 = matrix[i][2] - matrix[i][5];
+        tmp3 = matrix[i][3] + matrix[i][4];
+        tmp4 = matrix[i][3] - matrix[i][4];
 
-    in_file = fopen(argv[1], "rb");
-    out_file = fopen(argv[2], "wb");
+        tmp10 = tmp0 + tmp3;
+        tmp13 = tmp0 - tmp3;
+        tmp11 = tmp1 + tmp2;
+        tmp12 = tmp1 - tmp2;
 
-    bitmap = bitmap_read(in_file);
-    jpeg = jpeg_create_from_bmp(bitmap, quality);
-    jpeg_save(jpeg, out_file);
+        matrix[i][0] = LEFT_SHIFT(tmp10 + tmp11, PASS1_BITS);
+        matrix[i][4] = LEFT_SHIFT(tmp10 - tmp11, PASS1_BITS);
 
-    fclose(in_file);
-    fclose(out_file);
+        z1 = (tmp12 + tmp13) * FIX_0_541196100;
+        matrix[i][2] = DESCALE(z1 + tmp13 *  FIX_0_765366865, CONST_BITS - PASS1_BITS);
+        matrix[i][6] = DESCALE(z1 + tmp12 * -FIX_1_847759065, CONST_BITS - PASS1_BITS);
 
-    bitmap_free(bitmap);
-    jpeg_free(jpeg);
+        /* odd part */
+        z1 = tmp4 + tmp7;
+        z2 = tmp5 + tmp6;
+        z3 = tmp4 + tmp6;
+        z4 = tmp5 + tmp7;
+        z5 = (z3 + z4) * FIX_1_175875602;
+
+        tmp4 *= FIX_0_298631336;
+        tmp5 *= FIX_2_053119869;
+        tmp6 *= FIX_3_072711026;
+        tmp7 *= FIX_1_501321110;
+        z1 *= -FIX_0_899976223;
+        z2 *= -FIX_2_562915447;
+        z3 *= -FIX_1_961570560;
+        z4 *= -FIX_0_390180644;
+        z3 += z5;
+        z4 += z5;
+
+        matrix[i][7] = DESCALE(tmp4 + z1 + z3, CONST_BITS - PASS1_BITS);
+        matrix[i][5] = DESCALE(tmp5 + z2 + z4, CONST_BITS - PASS1_BITS);
+        matrix[i][3] = DESCALE(tmp6 + z2 + z3, CONST_BITS - PASS1_BITS);
+        matrix[i][1] = DESCALE(tmp7 + z1 + z4, CONST_BITS - PASS1_BITS);
+    }
+
+    /* columns */
+    for (i = 0; i < 8; i++)
+    {
+        /* even part */
+        tmp0 = matrix[0][i] + matrix[7][i];
+        tmp7 = matrix[0][i] - matrix[7][i];
+        tmp1 = matrix[1][i] + matrix[6][i];
+        tmp6 = matrix[1][i] - matrix[6][i];
+        tmp2 = matrix[2][i] + matrix[5][i];
+        tmp5 = matrix[2][i] - matrix[5][i];
+        tmp3 = matrix[3][i] + matrix[4][i];
+        tmp4 = matrix[3][i] - matrix[4][i];
+
+        tmp10 = tmp0 + tmp3;
+        tmp13 = tmp0 - tmp3;
+        tmp11 = tmp1 + tmp2;
+        tmp12 = tmp1 - tmp2;
+
+        matrix[0][i] = DESCALE(tmp10 + tmp11, PASS1_BITS);
+        matrix[4][i] = DESCALE(tmp10 - tmp11, PASS1_BITS);
+
+        z1 = (tmp12 + tmp13) * FIX_0_541196100;
+        matrix[2][i] = DESCALE(z1 + tmp13 *  FIX_0_765366865, CONST_BITS + PASS1_BITS);
+        matrix[6][i] = DESCALE(z1 + tmp12 * -FIX_1_847759065, CONST_BITS + PASS1_BITS);
+
+        /* odd part */
+        z1 = tmp4 + tmp7;
+        z2 = tmp5 + tmp6;
+        z3 = tmp4 + tmp6;
+        z4 = tmp5 + tmp7;
+        z5 = (z3 + z4) * FIX_1_175875602;
+
+        tmp4 *= FIX_0_298631336;
+        tmp5 *= FIX_2_053119869;
+        tmp6 *= FIX_3_072711026;
+        tmp7 *= FIX_1_501321110;
+        z1 *= -FIX_0_899976223;
+        z2 *= -FIX_2_562915447;
+        z3 *= -FIX_1_961570560;
+        z4 *= -FIX_0_390180644;
+        z3 += z5;
+        z4 += z5;
+
+        matrix[7][i] = DESCALE(tmp4 + z1 + z3, CONST_BITS + PASS1_BITS);
+        matrix[5][i] = DESCALE(tmp5 + z2 + z4, CONST_BITS + PASS1_BITS);
+        matrix[3][i] = DESCALE(tmp6 + z2 + z3, CONST_BITS + PASS1_BITS);
+        matrix[1][i] = DESCALE(tmp7 + z1 + z4, CONST_BITS + PASS1_BITS);
+    }
+}
+
+void dct_quantize_int(INT32 matrix[8][8], int comp, pJPEG jpeg, pBLOCK block)
+{
+    int natural[8][8];
+    int x, y;
+    INT32 divisor, value;
+
+    for (y = 0; y < 8; y++)
+    {
+        for (x = 0; x < 8; x++)
+        {
+            /* remove the scale of 8 left by dct_forward_int, round half away from zero */
+            divisor = (comp == 0 ? jpeg->quant_luma[y][x]: jpeg->quant_chroma[y][x]) << 3;
+            value = matrix[y][x];
+            if (value < 0)
+            {
+                natural[y][x] = (int) -((divisor / 2 - value) / divisor);
+            }
+            else
+            {
+                natural[y][x] = (int) ((divisor / 2 + value) / divisor);
+            }
+        }
+    }
+    dct_zigzag(natural, block);
+}
+
+int dct_flat_int(INT32 matrix[8][8], INT32 range, INT32 *dc)
+{
+    /* dct_flat for dct_forward_int, whose DC is exactly the sum of the samples */
+    const INT32 *p = matrix[0];
+    INT32 lo = p[0], hi = p[0], sum = 0;
+    int i;
+
+    if (FLAT_FAR(matrix[0][0], matrix[7][7], range) || FLAT_FAR(matrix[0][7], matrix[7][0], range) ||
+        FLAT_FAR(matrix[0][0], matrix[3][4], range))
+    {
+        return 0;
+    }
+    for (i = 0; i < 64; i++)
+    {
+        lo = (p[i] < lo) ? p[i] : lo;
+        hi = (p[i] > hi) ? p[i] : hi;
+        sum += p[i];
+    }
+    *dc = sum;
+    return hi - lo <= range;
+}
+
+void dct_quantize_dc_int(INT32 dc, int comp, pJPEG jpeg, pBLOCK block)
+{
+    INT32 divisor = (comp == 0 ? jpeg->quant_luma[0][0] : jpeg->quant_chroma[0][0]) << 3;
+
+    block->coef[0] = (int) ((dc < 0) ? -((divisor / 2 - dc) / divisor) : (divisor / 2 + dc) / divisor);
+    block->nonzero[0] = (block->coef[0] != 0);
+    block->nonzero[1] = 0;
+}
+
+BITCODE bitcode_join(BITCODE high, BITCODE low)
+{
+    BITCODE code;
+
+    code.value = high.value << low.nbits | low.value;
+    code.nbits = high.nbits + low.nbits;
+    return code;
+}
+
+void huffman_init(pJPEG jpeg)
+{
+    int h, i, index, temp;
+    int val, nbits, count;
+
+    /* Huffman */
+    HUFFMAN *huff;
+    UINT8  code_nbits[256];
+    BITCODE *huff_table, *pcode;
+
+    /* symbols without a code stay empty */
+    memset(jpeg->huff_table, 0, sizeof(jpeg->huff_table));
+    for (h = 0; h < 4; h++)
+    {
+        huff = &jpeg->huff[h];
+        huff_table = jpeg->huff_table[h];
+
+        index = 0;
+        for (nbits = 1; nbits <= 16; nbits++)
+        {
+            for (i = 0; i < huff->bits[nbits-1]; i++)
+            {
+                code_nbits[index++] = nbits;
+            }
+        }
+        count = index;
+
+        val = 0;
+        index = 0;
+        nbits = code_nbits[0];
+        while (index < count)
+        {
+            while (index < count && code_nbits[index] == nbits)
+            {
+                pcode = &(huff_table[huff->huffval[index]]);
+                pcode->value = val;
+                pcode->nbits = nbits;
+                val++;
+                index++;
+            }
+            val <<= 1;
+            nbits++;
+        }
+    }
+
+    /* VLI */
+    for (i = -2048; i < 2048; i++)
+    {
+        index = i & 0xFFF;
+        temp = val = i;
+        if (temp < 0)
+        {
+            temp = -temp;       /* temp should be positive */
+            val--;
+        }
+        nbits = 0;
+        while (temp != 0)
+        {
+            nbits++;
+            temp >>= 1;
+        }
+        val &= ~(-1 << nbits);
+        jpeg->vli_table[index].value = val;
+        jpeg->vli_table[index].nbits = nbits;
+    }
+
+    /*
+     * Huffman code and VLI, so that a coefficient is a single
+     * append. AC values outside of the table are rare and are
+     * joined in huffman_encode.
+     */
+    for (h = 0; h < 2; h++)
+    {
+        for (i = 0; i < 4096; i++)
+        {
+            jpeg->dc_code[h][i] = bitcode_join(jpeg->huff_table[h * 2][jpeg->vli_table[i].nbits],
+                                               jpeg->vli_table[i]);
+        }
+        for (temp = 0; temp < 16; temp++)
+        {
+            for (i = 0; i < 256; i++)
+            {
+                index = (i - 128) & 0xfff;
+                jpeg->ac_code[h][temp][(i - 128) & 0xff] =
+                    bitcode_join(jpeg->huff_table[h * 2 + 1][(temp << 4) | jpeg->vli_table[index].nbits],
+                                 jpeg->vli_table[index]);
+            }
+        }
+    }
+}
+
+#ifdef USE_STATS
+double stats_clock(void)
+{
+    /* seconds from some fixed point, as fine as the system allows */
+#ifdef CLOCK_MONOTONIC
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec * 1e-9;
+#else
+    return (double) clock() / CLOCKS_PER_SEC;
+#endif
+}
+
+void stats_add(pSTATS to, const STATS *from)
+{
+    int i;
+
+    for (i = 0; i < WSJPEG_STAGE_COUNT; i++)
+    {
+        to->stage_seconds[i] += from->stage_seconds[i];
+    }
+    to->blocks        += from->blocks;
+    to->zero_blocks   += from->zero_blocks;
+    to->skipped_blocks += from->skipped_blocks;
+    to->nonzero_coefs += from->nonzero_coefs;
+    to->zrl_codes     += from->zrl_codes;
+    to->eob_codes     += from->eob_codes;
+    to->stuffed_bytes += from->stuffed_bytes;
+    to->reallocs      += from->reallocs;
+    for (i = 0; i < 3; i++)
+    {
+        to->bits[i] += from->bits[i];
+    }
+    to->bytes += from->bytes;
+}
+#endif
+
+void stats_lap(pJPEG jpeg, int stage)
+{
+    /* add the time since the last lap to stage, or only start timing if stage is negative */
+#ifdef USE_STATS
+    double now;
+
+    if (jpeg->stats == NULL)
+    {
+        return;
+    }
+    now = stats_clock();
+    if (stage >= 0)
+    {
+        jpeg->stats->stage_seconds[stage] += now - jpeg->_lap;
+    }
+    jpeg->_lap = now;
+#else
+    (void) jpeg;
+    (void) stage;
+#endif
+}
+
+UINT32 stats_position(pJPEG jpeg)
+{
+    /* bits coded so far without stuffing, modulo 2^32, only differences are meaningful */
+#ifdef USE_STATS
+    if (jpeg->stats != NULL)
+    {
+        return (UINT32) ((jpeg->size - jpeg->stats->stuffed_bytes) * 8 + BITBUF_SIZE - jpeg->_nvacant);
+    }
+#else
+    (void) jpeg;
+#endif
+    return 0;
+}
+
+void stats_block(pJPEG jpeg, int comp, pBLOCK block, UINT32 position)
+{
+    /* count a block that has just been coded, position is stats_position before coding it */
+#ifdef USE_STATS
+    pSTATS stats = jpeg->stats;
+    UINT32 nonzero;
+    int i, k, last;
+
+    if (stats == NULL)
+    {
+        return;
+    }
+    stats->blocks++;
+    stats->bits[comp] += (UINT32) (stats_position(jpeg) - position);
+    stats->nonzero_coefs += (block->nonzero[0] & 1);
+    last = 0;
+    for (i = 0; i < 2; i++)
+    {
+        nonzero = block->nonzero[i] & ((i == 0) ? ~(UINT32) 1 : ~(UINT32) 0);
+        while (nonzero != 0)
+        {
+            k = i * 32 + bit_ctz(nonzero);
+            nonzero &= nonzero - 1;
+            stats->nonzero_coefs++;
+            stats->zrl_codes += (k - last - 1) / 16;
+            last = k;
+        }
+    }
+    if (last == 0)
+    {
+        stats->zero_blocks++;
+    }
+    if (last < 63)
+    {
+        stats->eob_codes++;
+    }
+#else
+    (void) jpeg;
+    (void) comp;
+    (void) block;
+    (void) position;
+#endif
+}
+
+void jpeg_reserve(pJPEG jpeg, SIZE_T bytes)
+{
+    /* extend the output buffer, only markers and joined buffers need it */
+    while (jpeg->capacity - jpeg->size < bytes)
+    {
+        jpeg->data = mem_realloc(jpeg->context, jpeg->data, jpeg->capacity * 2);
+        jpeg->capacity *= 2;
+#ifdef USE_STATS
+        if (jpeg->stats != NULL)
+        {
+            jpeg->stats->reallocs++;
+        }
+#endif
+    }
+}
+
+void huffman_putword(BITBUF word, pJPEG jpeg)
+{
+    /*
+     * Write a full bits buffer, most significant byte first. A
+     * 0xFF byte is followed by a zero byte (T.81 P.91 F.1.2.3),
+     * and words without any 0xFF byte, which are by far the most
+     * common, are found with a single test and copied as is.
+     * The buffer is sized by jpeg_mcu_bound, so there is always
+     * room.
+     */
+    const BITBUF ones = (BITBUF) -1 / 0xff;        /* 0x0101...01 */
+    BYTE *out = jpeg->data + jpeg->size;
+    int shift;
+
+    if (((~word - ones) & word & (ones << 7)) == 0)
+    {
+        for (shift = BITBUF_SIZE - 8; shift >= 0; shift -= 8)
+        {
+            *out++ = (BYTE) (word >> shift);
+        }
+    }
+    else
+    {
+        for (shift = BITBUF_SIZE - 8; shift >= 0; shift -= 8)
+        {
+            if ((*out++ = (BYTE) (word >> shift)) == 0xff)
+            {
+                *out++ = 0;
+#ifdef USE_STATS
+                if (jpeg->stats != NULL)
+                {
+                    jpeg->stats->stuffed_bytes++;
+                }
+#endif
+            }
+        }
+    }
+    jpeg->size = out - jpeg->data;
+}
+
+void huffman_putcode(BITCODE bitcode, pJPEG jpeg)
+{
+    BITBUF value = bitcode.value;
+    int length = bitcode.nbits;
+
+    if (length < jpeg->_nvacant)
+    {
+        jpeg->_buff = (jpeg->_buff << length) | value;
+        jpeg->_nvacant -= length;
+    }
+    else
+    {
+        /*
+         * Fill up the buffer and write it. The bits already written
+         * stay in the high part of _buff, until they are shifted out
+         * by the next BITBUF_SIZE - length bits.
+         */
+        length -= jpeg->_nvacant;
+        huffman_putword((jpeg->_buff << jpeg->_nvacant) | (value >> length), jpeg);
+        jpeg->_buff = value;
+        jpeg->_nvacant = BITBUF_SIZE - length;
+    }
+}
+
+void huffman_finish(pJPEG jpeg)
+{
+    int shift;
+
+    /* pad the last byte with zero and write the bits left over */
+    jpeg_reserve(jpeg, BITBUF_SIZE / 4);
+    for (shift = BITBUF_SIZE - jpeg->_nvacant - 8; shift > -8; shift -= 8)
+    {
+        if ((jpeg->data[(jpeg->size)++] = (BYTE) (shift >= 0 ? jpeg->_buff >> shift : jpeg->_buff << -shift)) == 0xff)
+        {
+            jpeg->data[(jpeg->size)++] = 0;         /* byte stuffing (T.81 P.91 F.1.2.3) */
+#ifdef USE_STATS
+            if (jpeg->stats != NULL)
+            {
+                jpeg->stats->stuffed_bytes++;
+            }
+#endif
+        }
+    }
+    jpeg->_buff = 0;
+    jpeg->_nvacant = BITBUF_SIZE;
+}
+
+void huffman_encode(pBLOCK block, int comp, int prev_dc, pJPEG jpeg)
+{
+    BITCODE vli_code, huff_code;
+    BITCODE *ac_table;
+    UINT32 nonzero;
+    int dc_diff, ac_value;
+    int i, k, last, r, h;
+
+    h = (comp == 0) ? 0 : 1;        /* Luma or Chroma */
+    ac_table = jpeg->huff_table[h * 2 + 1];
+
+    /*
+     * DC coefficient
+     */
+    dc_diff = block->coef[0] - prev_dc;
+    huffman_putcode(jpeg->dc_code[h][dc_diff & 0xfff], jpeg);
+
+    /*
+     * AC coefficients, jumping from one nonzero coefficient to
+     * the next, the zero runs are given by the distance
+     */
+    last = 0;
+    for (i = 0; i < 2; i++)
+    {
+        nonzero = block->nonzero[i];
+        if (i == 0)
+        {
+            nonzero &= ~(UINT32) 1;                         /* without DC */
+        }
+        while (nonzero != 0)
+        {
+            k = i * 32 + bit_ctz(nonzero);
+            nonzero &= nonzero - 1;
+            r = k - last - 1;
+            while (r > 15)
+            {
+                /* ZRL */
+                huff_code = ac_table[0xf0];
+                huffman_putcode(huff_code, jpeg);
+                r -= 16;
+            }
+            ac_value = block->coef[k];
+            if (ac_value >= -128 && ac_value < 128)
+            {
+                huff_code = jpeg->ac_code[h][r][ac_value & 0xff];
+            }
+            else
+            {
+                vli_code = jpeg->vli_table[ac_value & 0xfff];
+                huff_code = bitcode_join(ac_table[(r << 4) | vli_code.nbits], vli_code);
+            }
+            huffman_putcode(huff_code, jpeg);
+            last = k;
+        }
+    }
+    if (last < 63)
+    {
+        /* EOB */
+        huff_code = ac_table[0x00];
+        huffman_putcode(huff_code, jpeg);
+    }
+}
+
+void huffman_count(pBLOCK block, int comp, int prev_dc, pJPEG jpeg)
+{
+    /*
+     * Count the symbols huffman_encode would code for this block
+     */
+    UINT32 *dc_freq, *ac_freq;
+    UINT32 nonzero;
+    int i, k, last, r, h;
+
+    h = (comp == 0) ? 0 : 1;        /* Luma or Chroma */
+    dc_freq = jpeg->freq[h * 2];
+    ac_freq = jpeg->freq[h * 2 + 1];
+
+    dc_freq[jpeg->vli_table[(block->coef[0] - prev_dc) & 0xfff].nbits]++;
+
+    last = 0;
+    for (i = 0; i < 2; i++)
+    {
+        nonzero = block->nonzero[i];
+        if (i == 0)
+        {
+            nonzero &= ~(UINT32) 1;                         /* without DC */
+        }
+        while (nonzero != 0)
+        {
+            k = i * 32 + bit_ctz(nonzero);
+            nonzero &= nonzero - 1;
+            for (r = k - last - 1; r > 15; r -= 16)
+            {
+                ac_freq[0xf0]++;                            /* ZRL */
+            }
+            ac_freq[(r << 4) | jpeg->vli_table[block->coef[k] & 0xfff].nbits]++;
+            last = k;
+        }
+    }
+    if (last < 63)
+    {
+        ac_freq[0x00]++;                                    /* EOB */
+    }
+}
+
+void huffman_build_table(UINT32 freq[257], HUFFMAN *huff)
+{
+    /*
+     * Optimal code lengths limited to 16 bits (T.81 P.145
+     * K.2). Symbol 256 is a placeholder that takes the all-ones
+     * code, which no real symbol may have. freq is destroyed.
+     */
+    int codesize[257], others[257], bits[33];
+    int c1, c2, i, j, p;
+    UINT32 v;
+
+    for (i = 0; i < 257; i++)
+    {
+        codesize[i] = 0;
+        others[i] = -1;
+    }
+    freq[256] = 1;
+
+    for (;;)
+    {
+        /* the two least frequent symbols, the larger value on a tie */
+        c1 = c2 = -1;
+        v = 0xFFFFFFFF;
+        for (i = 0; i < 257; i++)
+        {
+            if (freq[i] != 0 && freq[i] <= v)
+            {
+                v = freq[i];
+                c1 = i;
+            }
+        }
+        v = 0xFFFFFFFF;
+        for (i = 0; i < 257; i++)
+        {
+            if (freq[i] != 0 && freq[i] <= v && i != c1)
+            {
+                v = freq[i];
+                c2 = i;
+            }
+        }
+        if (c2 < 0)
+        {
+            break;
+        }
+
+        /* merge them, one bit more for every symbol below */
+        freq[c1] += freq[c2];
+        freq[c2] = 0;
+        codesize[c1]++;
+        while (others[c1] >= 0)
+        {
+            c1 = others[c1];
+            codesize[c1]++;
+        }
+        others[c1] = c2;
+        codesize[c2]++;
+        while (others[c2] >= 0)
+        {
+            c2 = others[c2];
+            codesize[c2]++;
+        }
+    }
+
+    memset(bits, 0, sizeof(bits));
+    for (i = 0; i < 257; i++)
+    {
+        if (codesize[i] != 0)
+        {
+            bits[codesize[i] > 32 ? 32 : codesize[i]]++;
+        }
+    }
+
+    /* move the codes longer than 16 bits up the tree (K.3) */
+    for (i = 32; i > 16; i--)
+    {
+        while (bits[i] > 0)
+        {
+            j = i - 2;
+            while (bits[j] == 0)
+            {
+                j--;
+            }
+            bits[i] -= 2;
+            bits[i - 1]++;
+            bits[j + 1] += 2;
+            bits[j]--;
+        }
+    }
+
+    /* drop the placeholder, it has the longest code */
+    while (i > 0 && bits[i] == 0)
+    {
+        i--;
+    }
+    if (i > 0)
+    {
+        bits[i]--;
+    }
+
+    for (i = 1; i <= 16; i++)
+    {
+        huff->bits[i - 1] = bits[i];
+    }
+    p = 0;
+    for (i = 1; i <= 32; i++)
+    {
+        for (j = 0; j < 256; j++)
+        {
+            if (codesize[j] == i)
+            {
+                huff->huffval[p++] = j;
+            }
+        }
+    }
+}
+
+void coef_pack(pBLOCK block, pJPEG jpeg)
+{
+    /*
+     * Keep a block for the second pass: the DC coefficient in
+     * two bytes, the number of nonzero AC coefficients, then
+     * the position and the two bytes of the value of each.
+     */
+    UINT32 nonzero;
+    BYTE *out, *p;
+    int i, k;
+
+    if (jpeg->coefs_capacity - jpeg->coefs_size < 3 + 63 * 3)
+    {
+        jpeg->coefs_capacity = (jpeg->coefs_capacity == 0) ? 65536 : jpeg->coefs_capacity * 2;
+        jpeg->coefs = (jpeg->coefs == NULL) ? mem_alloc(jpeg->context, jpeg->coefs_capacity) :
+                                              mem_realloc(jpeg->context, jpeg->coefs, jpeg->coefs_capacity);
+#ifdef USE_STATS
+        if (jpeg->stats != NULL && jpeg->coefs_size != 0)
+        {
+            jpeg->stats->reallocs++;
+        }
+#endif
+    }
+    out = jpeg->coefs + jpeg->coefs_size;
+    out[0] = block->coef[0] & 0xff;
+    out[1] = (block->coef[0] >> 8) & 0xff;
+    p = out + 3;
+    for (i = 0; i < 2; i++)
+    {
+        nonzero = block->nonzero[i];
+        if (i == 0)
+        {
+            nonzero &= ~(UINT32) 1;                         /* without DC */
+        }
+        while (nonzero != 0)
+        {
+            k = i * 32 + bit_ctz(nonzero);
+            nonzero &= nonzero - 1;
+            *p++ = k;
+            *p++ = block->coef[k] & 0xff;
+            *p++ = (block->coef[k] >> 8) & 0xff;
+        }
+    }
+    out[2] = (BYTE) ((p - out - 3) / 3);
+    jpeg->coefs_size += p - out;
+}
+
+void coef_unpack(pBLOCK block, pJPEG jpeg)
+{
+    /* the next block kept by coef_pack, only coef[0] and the nonzero ones are set */
+    BYTE *in = jpeg->coefs + jpeg->coefs_read;
+    int n, k, value;
+
+    value = in[0] | in[1] << 8;
+    block->coef[0] = (value >= 0x8000) ? value - 0x10000 : value;
+    block->nonzero[0] = (block->coef[0] != 0);
+    block->nonzero[1] = 0;
+    n = in[2];
+    in += 3;
+    while (n-- > 0)
+    {
+        k = in[0];
+        value = in[1] | in[2] << 8;
+        block->coef[k] = (value >= 0x8000) ? value - 0x10000 : value;
+        block->nonzero[k >> 5] |= (UINT32) 1 << (k & 31);
+        in += 3;
+    }
+    jpeg->coefs_read = in - jpeg->coefs;
+}
+
+void huffman_optimize(pJPEG jpeg)
+{
+    /* replace the tables in use by ones built from the gathered counts, grayscale has no chroma */
+    int h;
+
+    for (h = 0; h < 2 * jpeg->sampling->comps && h < 4; h++)
+    {
+        huffman_build_table(jpeg->freq[h], &jpeg->huff[h]);
+    }
+    huffman_init(jpeg);
+}
+
+void huffman_code_lengths(const HUFFMAN *huff, UINT8 lengths[256])
+{
+    /* code length of every symbol, 0 if it has none, or 16 for all if the table is not known */
+    int i, j, k;
+
+    memset(lengths, (huff == NULL) ? 16 : 0, 256);
+    if (huff == NULL)
+    {
+        return;
+    }
+    k = 0;
+    for (i = 0; i < 16; i++)
+    {
+        for (j = 0; j < huff->bits[i]; j++)
+        {
+            lengths[huff->huffval[k++]] = i + 1;
+        }
+    }
+}
+
+int vli_size(UINT32 value)
+{
+    int size = 0;
+
+    while (value != 0)
+    {
+        value >>= 1;
+        size++;
+    }
+    return size;
+}
+
+UINT32 huffman_block_bound(UINT8 quant[8][8], const HUFFMAN *dc, const HUFFMAN *ac)
+{
+    /*
+     * Most bits a block can take. A quantized coefficient is
+     * bounded by DCT_GAIN and its quantizer, with one more for
+     * rounding, which limits its size. most[k] is the most bits
+     * of the coefficients up to k, if coef[k] is the last nonzero
+     * one so far; the zero run before it decides its code.
+     */
+    UINT8 dc_len[256], ac_len[256];
+    UINT32 most[64], bits, code, max;
+    int k, j, u, v, run, size, cat;
+
+    huffman_code_lengths(dc, dc_len);
+    huffman_code_lengths(ac, ac_len);
+
+    cat = vli_size(2 * ((UINT32) (32 * DCT_GAIN[0] * DCT_GAIN[0] / quant[0][0]) + 1));
+    cat = (cat > 11) ? 11 : cat;
+    most[0] = 0;
+    for (size = 0; size <= cat; size++)
+    {
+        if ((UINT32) dc_len[size] + size > most[0])
+        {
+            most[0] = dc_len[size] + size;
+        }
+    }
+
+    max = most[0] + ac_len[0x00];                                           /* EOB right away */
+    for (k = 1; k < 64; k++)
+    {
+        v = JPEG_NATURAL_ORDER[k] / 8;
+        u = JPEG_NATURAL_ORDER[k] % 8;
+        cat = vli_size((UINT32) (32 * DCT_GAIN[v] * DCT_GAIN[u] / quant[v][u]) + 1);
+        cat = (cat > 10) ? 10 : cat;
+        most[k] = 0;
+        for (j = 0; j < k; j++)
+        {
+            run = k - j - 1;
+            code = 0;
+            for (size = 1; size <= cat; size++)
+            {
+                if ((UINT32) ac_len[((run & 15) << 4) | size] + size > code)
+                {
+                    code = ac_len[((run & 15) << 4) | size] + size;
+                }
+            }
+            bits = most[j] + (run >> 4) * ac_len[0xf0] + code;
+            if (bits > most[k])
+            {
+                most[k] = bits;
+            }
+        }
+        bits = most[k] + ((k < 63) ? ac_len[0x00] : 0);
+        if (bits > max)
+        {
+            max = bits;
+        }
+    }
+    return max;
+}
+
+SIZE_T jpeg_mcu_bound(UINT8 quant_luma[8][8], UINT8 quant_chroma[8][8], const HUFFMAN huff[4],
+                      const SAMPLING *sampling)
+{
+    /* bytes of an MCU if every byte had to be stuffed, huff is NULL if the tables are not known */
+    UINT32 bits, luma_blocks;
+
+    luma_blocks = sampling->h[0] * sampling->v[0];
+    bits = luma_blocks * huffman_block_bound(quant_luma, huff ? &huff[0] : NULL, huff ? &huff[1] : NULL);
+    if (sampling->blocks > (int) luma_blocks)
+    {
+        bits += (sampling->blocks - luma_blocks) *
+                huffman_block_bound(quant_chroma, huff ? &huff[2] : NULL, huff ? &huff[3] : NULL);
+    }
+    return (bits + 7) / 8 * 2;
+}
+
+SIZE_T jpeg_scan_bound(SIZE_T mcu_bound, UINT32 mcus, UINT32 intervals)
+{
+    /*
+     * Bytes written while coding mcus MCUs that end intervals
+     * restart intervals: the bits still buffered from before,
+     * the MCUs, and the padding and RST marker of each interval.
+     * Saturates instead of overflowing.
+     */
+    SIZE_T extra = 2 * sizeof(BITBUF) + (SIZE_T) intervals * 4;
+
+    if (mcus != 0 && mcu_bound > ((SIZE_T) -1 - extra) / mcus)
+    {
+        return (SIZE_T) -1;
+    }
+    return mcus * mcu_bound + extra;
+}
+
+UINT32 jpeg_interval_count(UINT32 mcu_count, UINT16 restart_interval)
+{
+    /* without restart markers the whole scan is a single interval */
+    return (restart_interval != 0) ? (mcu_count + restart_interval - 1) / restart_interval : 1;
+}
+
+void jpeg_put_header(pJPEG jpeg)
+{
+    const SAMPLING *sampling = jpeg->sampling;
+    HUFFMAN *huff;
+    SIZE_T temp01, temp02;
+    int i, j, k, tables;
+    const int comp_id[3]        = {1, 2, 3};
+    const int quant_table_id[3] = {0, 1, 1};
+    const int dc_table_id[3]    = {0, 1, 1};
+    const int ac_table_id[3]    = {0, 1, 1};
+
+    /*
+     * Start of Image Marker
+     */
+    jpeg->data[jpeg->size++] = 0xff;
+    jpeg->data[jpeg->size++] = 0xd8;
+
+    /*
+     * Start of Frame Header (T.81 P.36)
+     */
+    jpeg->data[jpeg->size++] = 0xff;                                        /* SOF0 marker - 0xFFC0 */
+    jpeg->data[jpeg->size++] = 0xc0;
+    jpeg->data[jpeg->size++] = 0x00;                                        /* Length of segment excluding SOF0 marker */
+    jpeg->data[jpeg->size++] = 8 + 3 * sampling->comps;
+    jpeg->data[jpeg->size++] = 0x08;                                        /* Sample precision */
+    jpeg->data[jpeg->size++] = (jpeg->height >> 8 & 0xff);                  /* Number of lines */
+    jpeg->data[jpeg->size++] = (jpeg->height      & 0xff);
+    jpeg->data[jpeg->size++] = (jpeg->width  >> 8 & 0xff);                  /* Number of samples per line */
+    jpeg->data[jpeg->size++] = (jpeg->width       & 0xff);
+    jpeg->data[jpeg->size++] = sampling->comps;                             /* Number of image components in frame */
+
+    for (i = 0; i < sampling->comps; i++)
+    {
+        jpeg->data[jpeg->size++] = comp_id[i];                              /* Component identifier */
+        jpeg->data[jpeg->size++] = (( sampling->h[i] << 4 )|                /* Horizontal sampling factor */
+                                      sampling->v[i]       );               /* Vertical sampling factor */
+        jpeg->data[jpeg->size++] = quant_table_id[i];                       /* Quantization table destination selector */
+    }
+
+    /*
+     * Define Quantization Table header (T.81 P.39), grayscale
+     * only needs the luma tables
+     */
+    tables = (sampling->comps > 1) ? 2 : 1;
+    jpeg->data[jpeg->size++] = 0xff;                                        /* DQT marker - 0xFFDB */
+    jpeg->data[jpeg->size++] = 0xdb;
+    jpeg->data[jpeg->size++] = 0x00;                                        /* Length of segment excluding DQT marker */
+    jpeg->data[jpeg->size++] = 2 + 65 * tables;
+    for (i = 0; i < tables; i++)
+    {
+        jpeg->data[jpeg->size++] = (( 0 << 4 )|                             /* Quantization table element precision */
+                                      i       );                            /* Quantization table destination identifier */
+        for (j = 0; j < 64; j++)
+        {
+            k = JPEG_NATURAL_ORDER[j];
+            jpeg->data[jpeg->size++] = (i == 0) ?
+                                       jpeg->quant_luma  [k / 8][k % 8] :
+                                       jpeg->quant_chroma[k / 8][k % 8];
+        }
+    }
+
+    /*
+     * Define Huffman Table Header (T.81 P.40)
+     */
+    jpeg->data[jpeg->size++] = 0xff;                                        /* DHT marker - 0xFFC4 */
+    jpeg->data[jpeg->size++] = 0xc4;
+    temp01 = jpeg->size++;                                                  /* (position of length) */
+    temp02 = jpeg->size++;
+    for (i = 0; i < 2 * tables; i++)
+    {
+        huff = &jpeg->huff[i];
+        jpeg->data[jpeg->size++] = huff->id;                                /* Table class & Huffman table destination id */
+        k = 0;
+        for (j = 0; j < 16; j++)
+        {
+            k += (jpeg->data[jpeg->size++] = huff->bits[j]);                /* Number of Huffman codes of length i */
+        }
+        for (j = 0; j < k; j++)
+        {
+            jpeg->data[jpeg->size++] = huff->huffval[j];                    /* Value associated with each Huffman code */
+        }
+    }
+    k = (int) (jpeg->size - temp01);
+    jpeg->data[temp01] = (k >> 8) & 0xff;                                   /* Length of segment excluding DHT marker */
+    jpeg->data[temp02] = (k     ) & 0xff;
+
+    /*
+     * Define Restart Interval (T.81 P.43)
+     */
+    if (jpeg->restart_interval != 0)
+    {
+        jpeg->data[jpeg->size++] = 0xff;                                    /* DRI marker - 0xFFDD */
+        jpeg->data[jpeg->size++] = 0xdd;
+        jpeg->data[jpeg->size++] = 0x00;                                    /* Length of segment excluding DRI marker */
+        jpeg->data[jpeg->size++] = 0x04;
+        jpeg->data[jpeg->size++] = (jpeg->restart_interval >> 8 & 0xff);    /* Restart interval */
+        jpeg->data[jpeg->size++] = (jpeg->restart_interval      & 0xff);
+    }
+
+    /*
+     * Start of Scan Header (T.81 P.37)
+     */
+    jpeg->data[jpeg->size++] = 0xff;                                        /* SOS marker - 0xFFDA */
+    jpeg->data[jpeg->size++] = 0xda;
+    jpeg->data[jpeg->size++] = 0x00;                                        /* Length of segment excluding SOS marker */
+    jpeg->data[jpeg->size++] = 6 + 2 * sampling->comps;
+    jpeg->data[jpeg->size++] = sampling->comps;                             /* Number of image components in scan */
+    for (i = 0; i < sampling->comps; i++)
+    {
+        jpeg->data[jpeg->size++] = comp_id[i];
+        jpeg->data[jpeg->size++] = (( dc_table_id[i] << 4 )|                /* DC entropy coding table destination selector */
+                                      ac_table_id[i]       );               /* AC entropy coding table destination selector */
+    }
+    jpeg->data[jpeg->size++] = 0x00;                                        /* Start of spectral or predictor selection */
+    jpeg->data[jpeg->size++] = 0x3f;                                        /* End of spectral selection */
+    jpeg->data[jpeg->size++] = 0x00;                                        /* Successive approximation bit position high & low */
+}
+
+void jpeg_put_rst(pJPEG jpeg, UINT32 interval)
+{
+    /*
+     * Restart Marker (T.81 P.32), numbered modulo 8
+     */
+    jpeg_reserve(jpeg, 2);
+    jpeg->data[jpeg->size++] = 0xff;                                        /* RSTm marker - 0xFFD0 ~ 0xFFD7 */
+    jpeg->data[jpeg->size++] = 0xd0 | (interval & 7);
+}
+
+void jpeg_put_eoi(pJPEG jpeg)
+{
+    /*
+     * End of Image Marker
+     */
+    jpeg_reserve(jpeg, 2);
+    jpeg->data[jpeg->size++] = 0xff;                                        /* EOI marker - 0xFFD9 */
+    jpeg->data[jpeg->size++] = 0xd9;
+}
+
+void jpeg_flush(pJPEG jpeg)
+{
+    /*
+     * Hand the finished bytes to the output, so that the buffer
+     * only has to hold one row of MCUs.
+     */
+    if (jpeg->write == NULL || jpeg->size == 0)
+    {
+        return;
+    }
+    if (jpeg->write(jpeg->opaque, jpeg->data, jpeg->size) != 0)
+    {
+        error_raise(jpeg->context, WSJPEG_ERROR_WRITE);
+    }
+#ifdef USE_STATS
+    if (jpeg->stats != NULL)
+    {
+        jpeg->stats->bytes += jpeg->size;
+    }
+#endif
+    jpeg->size = 0;
+}
+
+void jpeg_split_luma(FLOAT y[][16], int rows, FLOAT blocks[][8][8])
+{
+    /* rows of 16 luma samples into the blocks of an MCU, left and right, top to bottom */
+    int b;
+
+    for (b = 0; b < rows; b++)
+    {
+        memcpy(blocks[b / 8 * 2    ][b % 8], y[b]    , 8 * sizeof(FLOAT));
+        memcpy(blocks[b / 8 * 2 + 1][b % 8], y[b] + 8, 8 * sizeof(FLOAT));
+    }
+}
+
+void jpeg_gather_420(const BYTE *bgr, SIZE_T stride, FLOAT blocks[][8][8])
+{
+    /* 16x16 pixels, four luma blocks, chroma averaged over every 2x2 */
+    FLOAT y[16][16];
+    int b;
+
+    for (b = 0; b < 8; b++)
+    {
+        color_convert_subsample(bgr + b * 2 * stride, stride, 2, 16, y[b * 2], y[b * 2 + 1],
+                                blocks[4][b], blocks[5][b]);
+    }
+    jpeg_split_luma(y, 16, blocks);
+}
+
+void jpeg_gather_422(const BYTE *bgr, SIZE_T stride, FLOAT blocks[][8][8])
+{
+    /* 16x8 pixels, two luma blocks, chroma averaged over every pair */
+    FLOAT y[8][16];
+    int b;
+
+    for (b = 0; b < 8; b++)
+    {
+        color_convert_subsample(bgr + b * stride, stride, 1, 16, y[b], NULL, blocks[2][b], blocks[3][b]);
+    }
+    jpeg_split_luma(y, 8, blocks);
+}
+
+void jpeg_gather_444(const BYTE *bgr, SIZE_T stride, FLOAT blocks[][8][8])
+{
+    /* 8x8 pixels, converted straight into their blocks */
+    int b;
+
+    for (b = 0; b < 8; b++)
+    {
+        color_convert(bgr + b * stride, 8, blocks[0][b], blocks[1][b], blocks[2][b]);
+    }
+}
+
+void jpeg_gather_gray(const BYTE *bgr, SIZE_T stride, FLOAT blocks[][8][8])
+{
+    int b;
+
+    for (b = 0; b < 8; b++)
+    {
+        color_convert_gray(bgr + b * stride, 8, blocks[0][b]);
+    }
+}
+
+/*
+ * The same with the vector color kernels, which only pay off
+ * when they are inlined for a whole MCU, so every level has a
+ * gather function of its own for every sampling.
+ */
+#ifdef SIMD_SSE2
+SIMD_TARGET("sse2") void jpeg_gather_420_sse2(const BYTE *bgr, SIZE_T stride, FLOAT blocks[][8][8])
+{
+    FLOAT y[16][16];
+    int b;
+
+    for (b = 0; b < 8; b++)
+    {
+        color_convert_subsample_sse2(bgr + b * 2 * stride, stride, 2, 16, y[b * 2], y[b * 2 + 1],
+                                     blocks[4][b], blocks[5][b]);
+    }
+    jpeg_split_luma(y, 16, blocks);
+}
+
+SIMD_TARGET("sse2") void jpeg_gather_422_sse2(const BYTE *bgr, SIZE_T stride, FLOAT blocks[][8][8])
+{
+    FLOAT y[8][16];
+    int b;
+
+    for (b = 0; b < 8; b++)
+    {
+        color_convert_subsample_sse2(bgr + b * stride, stride, 1, 16, y[b], NULL, blocks[2][b], blocks[3][b]);
+    }
+    jpeg_split_luma(y, 8, blocks);
+}
+
+SIMD_TARGET("sse2") void jpeg_gather_444_sse2(const BYTE *bgr, SIZE_T stride, FLOAT blocks[][8][8])
+{
+    int b;
+
+    for (b = 0; b < 8; b++)
+    {
+        color_convert_sse2(bgr + b * stride, 8, blocks[0][b], blocks[1][b], blocks[2][b]);
+    }
+}
+
+SIMD_TARGET("sse2") void jpeg_gather_gray_sse2(const BYTE *bgr, SIZE_T stride, FLOAT blocks[][8][8])
+{
+    int b;
+
+    for (b = 0; b < 8; b++)
+    {
+        color_convert_gray_sse2(bgr + b * stride, 8, blocks[0][b]);
+    }
+}
+#endif
+
+#ifdef SIMD_AVX2
+SIMD_TARGET("avx2") void jpeg_gather_420_avx2(const BYTE *bgr, SIZE_T stride, FLOAT blocks[][8][8])
+{
+    FLOAT y[16][16];
+    int b;
+
+    for (b = 0; b < 8; b++)
+    {
+        color_convert_subsample_avx2(bgr + b * 2 * stride, stride, 2, 16, y[b * 2], y[b * 2 + 1],
+                                     blocks[4][b], blocks[5][b]);
+    }
+    jpeg_split_luma(y, 16, blocks);
+}
+
+SIMD_TARGET("avx2") void jpeg_gather_422_avx2(const BYTE *bgr, SIZE_T stride, FLOAT blocks[][8][8])
+{
+    FLOAT y[8][16];
+    int b;
+
+    for (b = 0; b < 8; b++)
+    {
+        color_convert_subsample_avx2(bgr + b * stride, stride, 1, 16, y[b], NULL, blocks[2][b], blocks[3][b]);
+    }
+    jpeg_split_luma(y, 8, blocks);
+}
+
+SIMD_TARGET("avx2") void jpeg_gather_444_avx2(const BYTE *bgr, SIZE_T stride, FLOAT blocks[][8][8])
+{
+    int b;
+
+    for (b = 0; b < 8; b++)
+    {
+        color_convert_avx2(bgr + b * stride, 8, blocks[0][b], blocks[1][b], blocks[2][b]);
+    }
+}
+
+SIMD_TARGET("avx2") void jpeg_gather_gray_avx2(const BYTE *bgr, SIZE_T stride, FLOAT blocks[][8][8])
+{
+    int b;
+
+    for (b = 0; b < 8; b++)
+    {
+        color_convert_gray_avx2(bgr + b * stride, 8, blocks[0][b]);
+    }
+}
+#endif
+
+void jpeg_gather_420_int(const INT32 *table, const BYTE *bgr, SIZE_T stride, INT32 blocks[][8][8])
+{
+    /* jpeg_gather_420 with color_convert_subsample_int */
+    INT32 y[16][16];
+    int a, b;
+
+    for (b = 0; b < 8; b++)
+    {
+        color_convert_subsample_int(table, bgr + b * 2 * stride, stride, 2, 16, y[b * 2], y[b * 2 + 1],
+                                    blocks[4][b], blocks[5][b]);
+    }
+    for (b = 0; b < 8; b++)
+    {
+        for (a = 0; a < 8; a++)
+        {
+            blocks[0][b][a] = y[b    ][a    ];
+            blocks[1][b][a] = y[b    ][a + 8];
+            blocks[2][b][a] = y[b + 8][a    ];
+            blocks[3][b][a] = y[b + 8][a + 8];
+        }
+    }
+}
+
+void jpeg_gather_422_int(const INT32 *table, const BYTE *bgr, SIZE_T stride, INT32 blocks[][8][8])
+{
+    INT32 y[8][16];
+    int a, b;
+
+    for (b = 0; b < 8; b++)
+    {
+        color_convert_subsample_int(table, bgr + b * stride, stride, 1, 16, y[b], NULL, blocks[2][b], blocks[3][b]);
+    }
+    for (b = 0; b < 8; b++)
+    {
+        for (a = 0; a < 8; a++)
+        {
+            blocks[0][b][a] = y[b][a    ];
+            blocks[1][b][a] = y[b][a + 8];
+        }
+    }
+}
+
+void jpeg_gather_444_int(const INT32 *table, const BYTE *bgr, SIZE_T stride, INT32 blocks[][8][8])
+{
+    int b;
+
+    for (b = 0; b < 8; b++)
+    {
+        color_convert_int(table, bgr + b * stride, 8, blocks[0][b], blocks[1][b], blocks[2][b]);
+    }
+}
+
+void jpeg_gather_gray_int(const INT32 *table, const BYTE *bgr, SIZE_T stride, INT32 blocks[][8][8])
+{
+    int b;
+
+    for (b = 0; b < 8; b++)
+    {
+        color_convert_gray_int(table, bgr + b * stride, 8, blocks[0][b]);
+    }
+}
+
+const SAMPLING SAMPLINGS[SAMPLING_COUNT] =
+{
+    {3, {2, 1, 1}, {2, 1, 1}, 16, 16, 6, {0, 0, 0, 0, 1, 2}, jpeg_gather_420_int},
+    {3, {2, 1, 1}, {1, 1, 1}, 16,  8, 4, {0, 0, 1, 2},       jpeg_gather_422_int},
+    {3, {1, 1, 1}, {1, 1, 1},  8,  8, 3, {0, 1, 2},          jpeg_gather_444_int},
+    {1, {1, 0, 0}, {1, 0, 0},  8,  8, 1, {0},                jpeg_gather_gray_int}
+};
+
+const KERNELS KERNELS_C =
+{
+    1, {jpeg_gather_420, jpeg_gather_422, jpeg_gather_444, jpeg_gather_gray},
+    dct_forward_block, dct_scale, dct_spread, dct_round
+};
+
+#ifdef SIMD_SSE2
+const KERNELS KERNELS_SSE2 =
+{
+    4, {jpeg_gather_420_sse2, jpeg_gather_422_sse2, jpeg_gather_444_sse2, jpeg_gather_gray_sse2},
+    dct_forward_lanes_sse2, dct_scale_sse2, dct_spread_sse2, dct_round_sse2
+};
+#endif
+
+#ifdef SIMD_AVX2
+const KERNELS KERNELS_AVX2 =
+{
+    8, {jpeg_gather_420_avx2, jpeg_gather_422_avx2, jpeg_gather_444_avx2, jpeg_gather_gray_avx2},
+    dct_forward_lanes_avx2, dct_scale_avx2, dct_spread_avx2, dct_round_sse2
+};
+#endif
+
+/* the kernels of every SIMD level, NULL if not built in */
+const KERNELS *const SIMD_KERNELS[SIMD_COUNT] =
+{
+    NULL,
+    &KERNELS_C,
+#ifdef SIMD_SSE2
+    &KERNELS_SSE2,
+#else
+    NULL,
+#endif
+#ifdef SIMD_AVX2
+    &KERNELS_AVX2
+#else
+    NULL
+#endif
+};
+
+const char *SIMD_NAMES[SIMD_COUNT] = {"auto", "none", "sse2", "avx2"};
+
+int simd_parse(const char *name)
+{
+    /* the WSJPEG_SIMD_* level called name, -1 if there is none */
+    int simd;
+
+    for (simd = 0; simd < SIMD_COUNT; simd++)
+    {
+        if (strcmp(name, SIMD_NAMES[simd]) == 0)
+        {
+            return simd;
+        }
+    }
+    return -1;
+}
+
+int simd_supported(int simd)
+{
+    /* whether the kernels of simd are built in and the processor runs them */
+    if (simd <= WSJPEG_SIMD_AUTO || simd >= SIMD_COUNT || SIMD_KERNELS[simd] == NULL)
+    {
+        return 0;
+    }
+#ifdef SIMD_DETECT
+    if (simd == WSJPEG_SIMD_SSE2)
+    {
+        return __builtin_cpu_supports("sse2");
+    }
+    if (simd == WSJPEG_SIMD_AVX2)
+    {
+        return __builtin_cpu_supports("avx2");
+    }
+#endif
+    return 1;
+}
+
+int simd_resolve(int simd)
+{
+    /*
+     * The level an encoder asking for simd uses: the widest one
+     * supported for WSJPEG_SIMD_AUTO, unless the WSJPEG_SIMD
+     * environment variable names another, so that every path can
+     * be timed and a bug reproduced without rebuilding. -1 if the
+     * level is not supported.
+     */
+    const char *name;
+
+    if (simd == WSJPEG_SIMD_AUTO && (name = getenv("WSJPEG_SIMD")) != NULL && name[0] != '\0')
+    {
+        simd = simd_parse(name);
+    }
+    if (simd == WSJPEG_SIMD_AUTO)
+    {
+        simd = SIMD_COUNT - 1;
+        while (!simd_supported(simd))
+        {
+            simd--;
+        }
+        return simd;
+    }
+    return simd_supported(simd) ? simd : -1;
+}
+
+int jpeg_mcu_repeats(const BYTE *bgr, SIZE_T stride, const SAMPLING *sampling)
+{
+    /* whether the MCU at bgr has the same pixels as the one to its left */
+    SIZE_T width = sampling->mcu_width * 3;
+    UINT32 y;
+
+    for (y = 0; y < sampling->mcu_height; y++)
+    {
+        if (memcmp(bgr + y * stride - width, bgr + y * stride, width) != 0)
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+void jpeg_transform_mcus(BYTE *staging, SIZE_T stride, pJPEG jpeg, UINT32 x_unit, int count, BLOCK *coefs)
+{
+    /*
+     * Quantized blocks of count MCUs of the staged row from
+     * x_unit on, in coding order. Small MCUs are transformed
+     * a few at a time, so that the SIMD DCT gets full lanes.
+     * Blocks too flat for any AC coefficient to survive the
+     * quantizer skip the DCT, only their DC is worked out, and
+     * an MCU that repeats the one before it is copied. The
+     * cache keeps blocks for any quality, so there only blocks
+     * of a single value count as flat. With COLOR_INTEGER and
+     * DCT_INTEGER no sample goes through floating point.
+     */
+    const SAMPLING *sampling = jpeg->sampling;
+    FLOAT blocks[MCU_GROUP_BLOCKS][8][8];
+    INT32 int_blocks[MCU_GROUP_BLOCKS][8][8];
+    FLOAT dc[MCU_GROUP_BLOCKS], range[2];
+    INT32 dc_int[MCU_GROUP_BLOCKS], int_range[2];
+    int kind[MCU_GROUP_BLOCKS];
+    int a, b, c, n, m, comp, flat;
+    BYTE *bgr;
+
+    /* Color space conversion and subsampling */
+    n = count * sampling->blocks;
+    for (a = 0; a < count; a++)
+    {
+        bgr = staging + (x_unit + a) * sampling->mcu_width * 3;
+        kind[a * sampling->blocks] = (a > 0 && jpeg_mcu_repeats(bgr, stride, sampling)) ? BLOCK_REPEAT : BLOCK_DCT;
+        if (kind[a * sampling->blocks] == BLOCK_DCT && jpeg->color_method == COLOR_INTEGER)
+        {
+            sampling->gather_int(jpeg->color_table, bgr, stride, int_blocks + a * sampling->blocks);
+        }
+        else if (kind[a * sampling->blocks] == BLOCK_DCT)
+        {
+            jpeg->gather(bgr, stride, blocks + a * sampling->blocks);
+        }
+    }
+
+    /* the blocks left to transform are moved to the front */
+    for (c = 0; c < 2; c++)
+    {
+        range[c] = (jpeg->pass == PASS_CACHE) ? 0 : jpeg->flat_range[c];
+        int_range[c] = (INT32) range[c];
+    }
+    for (a = m = 0; a < n; a++)
+    {
+        if (kind[a - a % sampling->blocks] == BLOCK_REPEAT)
+        {
+            kind[a] = BLOCK_REPEAT;
+            continue;
+        }
+        comp = (sampling->block_comp[a % sampling->blocks] == 0) ? 0 : 1;
+        if (jpeg->dct_method == DCT_INTEGER && jpeg->color_method == COLOR_INTEGER)
+        {
+            if (m != a)
+            {
+                memcpy(int_blocks[m], int_blocks[a], sizeof(int_blocks[a]));
+            }
+            flat = dct_flat_int(int_blocks[m], int_range[comp], &dc_int[a]);
+        }
+        else if (jpeg->dct_method == DCT_INTEGER)
+        {
+            for (b = 0; b < 8; b++)
+            {
+                for (c = 0; c < 8; c++)
+                {
+                    int_blocks[m][b][c] = (INT32) (blocks[a][b][c] + 128.5) - 128;
+                }
+            }
+            flat = dct_flat_int(int_blocks[m], int_range[comp], &dc_int[a]);
+        }
+        else
+        {
+            if (jpeg->color_method == COLOR_INTEGER)
+            {
+                for (b = 0; b < 8; b++)
+                {
+                    for (c = 0; c < 8; c++)
+                    {
+                        blocks[a][b][c] = (FLOAT) int_blocks[a][b][c];
+                    }
+                }
+            }
+            flat = dct_flat(jpeg->kernels, blocks[a], range[comp], &dc[a]);
+            if (!flat && m != a)
+            {
+                memcpy(blocks[m], blocks[a], sizeof(blocks[a]));
+            }
+        }
+        kind[a] = flat ? BLOCK_FLAT : BLOCK_DCT;
+        m += !flat;
+    }
+#ifdef USE_STATS
+    if (jpeg->stats != NULL)
+    {
+        jpeg->stats->skipped_blocks += n - m;
+    }
+#endif
+    stats_lap(jpeg, WSJPEG_STAGE_COLOR);
+
+    if (jpeg->dct_method == DCT_FLOAT)
+    {
+        dct_forward_blocks(jpeg->kernels, blocks, m);
+    }
+    else
+    {
+        for (a = 0; a < m; a++)
+        {
+            dct_forward_int(int_blocks[a]);
+        }
+    }
+    stats_lap(jpeg, WSJPEG_STAGE_DCT);
+
+    if (jpeg->pass == PASS_CACHE)
+    {
+        for (a = m = 0; a < n; a++, jpeg->cache_size++)
+        {
+            if (kind[a] == BLOCK_REPEAT)
+            {
+                jpeg->cache[jpeg->cache_size] = jpeg->cache[jpeg->cache_size - sampling->blocks];
+            }
+            else if (jpeg->dct_method == DCT_INTEGER)
+            {
+                if (kind[a] == BLOCK_FLAT)
+                {
+                    memset(jpeg->cache[jpeg->cache_size].i, 0, sizeof(int_blocks[0]));
+                    jpeg->cache[jpeg->cache_size].i[0][0] = dc_int[a];
+                }
+                else
+                {
+                    memcpy(jpeg->cache[jpeg->cache_size].i, int_blocks[m++], sizeof(int_blocks[0]));
+                }
+            }
+            else
+            {
+                if (kind[a] == BLOCK_FLAT)
+                {
+                    memset(jpeg->cache[jpeg->cache_size].f, 0, sizeof(blocks[0]));
+                    jpeg->cache[jpeg->cache_size].f[0][0] = dc[a];
+                }
+                else
+                {
+                    memcpy(jpeg->cache[jpeg->cache_size].f, blocks[m++], sizeof(blocks[0]));
+                }
+            }
+        }
+        stats_lap(jpeg, WSJPEG_STAGE_DCT);
+        return;
+    }
+
+    for (a = m = 0; a < n; a++)
+    {
+        comp = sampling->block_comp[a % sampling->blocks];
+        if (kind[a] == BLOCK_REPEAT)
+        {
+            coefs[a] = coefs[a - sampling->blocks];
+        }
+        else if (jpeg->dct_method == DCT_INTEGER)
+        {
+            if (kind[a] == BLOCK_FLAT)
+            {
+                dct_quantize_dc_int(dc_int[a], comp, jpeg, &coefs[a]);
+            }
+            else
+            {
+                dct_quantize_int(int_blocks[m++], comp, jpeg, &coefs[a]);
+            }
+        }
+        else
+        {
+            if (kind[a] == BLOCK_FLAT)
+            {
+                dct_quantize_dc(dc[a], comp, jpeg, &coefs[a]);
+            }
+            else
+            {
+                dct_quantize(blocks[m++], comp, jpeg, &coefs[a]);
+            }
+        }
+    }
+    stats_lap(jpeg, WSJPEG_STAGE_QUANTIZE);
+}
+
+void jpeg_code_mcu(pJPEG jpeg, BLOCK coefs[6], int prev_dc[3])
+{
+    UINT32 position;
+    int comp, a;
+
+    for (a = 0; a < jpeg->sampling->blocks; a++)
+    {
+        comp = jpeg->sampling->block_comp[a];
+        if (jpeg->pass == PASS_GATHER)
+        {
+            huffman_count(&coefs[a], comp, prev_dc[comp], jpeg);
+            coef_pack(&coefs[a], jpeg);
+        }
+        else
+        {
+            position = stats_position(jpeg);
+            huffman_encode(&coefs[a], comp, prev_dc[comp], jpeg);
+            stats_block(jpeg, comp, &coefs[a], position);
+        }
+
+        prev_dc[comp] = coefs[a].coef[0];
+    }
+    stats_lap(jpeg, WSJPEG_STAGE_HUFFMAN);
+}
+
+void jpeg_replay_mcu(pJPEG jpeg, int prev_dc[3])
+{
+    BLOCK block;
+    UINT32 position;
+    int comp, a;
+
+    for (a = 0; a < jpeg->sampling->blocks; a++)
+    {
+        comp = jpeg->sampling->block_comp[a];
+        coef_unpack(&block, jpeg);
+        position = stats_position(jpeg);
+        huffman_encode(&block, comp, prev_dc[comp], jpeg);
+        stats_block(jpeg, comp, &block, position);
+        prev_dc[comp] = block.coef[0];
+    }
+    stats_lap(jpeg, WSJPEG_STAGE_HUFFMAN);
+}
+
+void jpeg_quantize_cached(pJPEG jpeg, BLOCK coefs[6])
+{
+    /* quantized blocks of the next MCU of the cache */
+    pDCTBLOCK raw;
+    int comp, a;
+
+    for (a = 0; a < jpeg->sampling->blocks; a++)
+    {
+        comp = jpeg->sampling->block_comp[a];
+        raw = &jpeg->cache[jpeg->cache_read++];
+        if (jpeg->dct_method == DCT_INTEGER)
+        {
+            dct_quantize_int(raw->i, comp, jpeg, &coefs[a]);
+        }
+        else
+        {
+            dct_quantize(raw->f, comp, jpeg, &coefs[a]);
+        }
+    }
+    stats_lap(jpeg, WSJPEG_STAGE_QUANTIZE);
+}
+
+BLOCK *jpeg_pipe_take(pJPEG jpeg, UINT32 row)
+{
+    /* waits for the blocks of row, the coder is done with every row before it */
+#ifdef USE_PTHREAD
+    pPIPE pipe = jpeg->pipe;
+    UINT32 slot = row % pipe->slot_count;
+    int error;
+
+    pthread_mutex_lock(&pipe->lock);
+    pipe->done = row;
+    pthread_cond_broadcast(&pipe->free);
+    while (pipe->slot_row[slot] != row && pipe->error == WSJPEG_OK)
+    {
+        pthread_cond_wait(&pipe->ready, &pipe->lock);
+    }
+    error = pipe->error;
+    pthread_mutex_unlock(&pipe->lock);
+    if (error != WSJPEG_OK)
+    {
+        error_raise(jpeg->context, error);
+    }
+    return pipe->blocks + (SIZE_T) slot * jpeg->x_unit_count * jpeg->sampling->blocks;
+#else
+    (void) jpeg;
+    (void) row;
+    return NULL;
+#endif
+}
+
+void jpeg_encode_intervals(pBITMAP bitmap, pJPEG jpeg, UINT32 first, UINT32 last)
+{
+    UINT32 interval, mcu, mcu_end, mcu_count, x_unit, y_unit, y_staged;
+    UINT32 mcu_width = jpeg->sampling->mcu_width, mcu_height = jpeg->sampling->mcu_height;
+    SIZE_T stride;
+    BYTE *staging;
+    BLOCK mcu_coefs[MCU_GROUP_BLOCKS], *row_coefs = NULL, *coefs;
+    UINT32 x_first = 0, x_done = 0;
+    int prev_dc[3], group;
+
+    /* without restart markers the whole scan is a single interval */
+    mcu_count = jpeg->x_unit_count * jpeg->y_unit_count;
+    interval = (jpeg->restart_interval != 0) ? jpeg->restart_interval : mcu_count;
+
+    /*
+     * The pixels of a row of MCUs are copied into the staging
+     * buffer once, padded to whole MCUs. One more byte is needed
+     * for color_convert.
+     */
+    stride = jpeg->x_unit_count * mcu_width * 3;
+    staging = (jpeg->pass != PASS_REPLAY && jpeg->pipe == NULL && !jpeg->cached) ?
+              mem_alloc(jpeg->context, mcu_height * stride + 1) : NULL;
+    group = MCU_GROUP_BLOCKS / jpeg->sampling->blocks;
+    y_staged = jpeg->y_unit_count;
+
+    stats_lap(jpeg, -1);
+    for (; first < last; first++)
+    {
+        prev_dc[0] = prev_dc[1] = prev_dc[2] = 0;
+        mcu_end = (mcu_count - first * interval > interval) ? (first + 1) * interval : mcu_count;
+        /* Minimum Coded Units */
+        for (mcu = first * interval; mcu < mcu_end; mcu++)
+        {
+            x_unit = mcu % jpeg->x_unit_count;
+            y_unit = mcu / jpeg->x_unit_count;
+            if (jpeg->pass == PASS_REPLAY)
+            {
+                jpeg_replay_mcu(jpeg, prev_dc);
+            }
+            else if (jpeg->cached)
+            {
+                jpeg_quantize_cached(jpeg, mcu_coefs);
+                jpeg_code_mcu(jpeg, mcu_coefs, prev_dc);
+            }
+            else
+            {
+                if (y_unit != y_staged && jpeg->pipe != NULL)
+                {
+                    /* the time spent waiting is not a stage of its own */
+                    row_coefs = jpeg_pipe_take(jpeg, y_unit);
+                    y_staged = y_unit;
+                    stats_lap(jpeg, -1);
+                }
+                else if (y_unit != y_staged)
+                {
+                    if (bitmap->fp != NULL)
+                    {
+                        bitmap_read_band(bitmap, y_unit * mcu_height, mcu_height);
+                    }
+                    else
+                    {
+                        bitmap_prefetch(bitmap, (y_unit + 1) * mcu_height, mcu_height);
+                    }
+                    bitmap_get_rows(bitmap, y_unit * mcu_height, mcu_height, jpeg->x_unit_count * mcu_width, staging);
+                    y_staged = y_unit;
+                    x_done = 0;
+                    stats_lap(jpeg, WSJPEG_STAGE_READ);
+                }
+                if (jpeg->pipe != NULL)
+                {
+                    coefs = row_coefs + x_unit * jpeg->sampling->blocks;
+                }
+                else
+                {
+                    if (x_unit >= x_done)
+                    {
+                        x_first = x_unit;
+                        x_done = (jpeg->x_unit_count - x_unit > (UINT32) group) ? x_unit + group : jpeg->x_unit_count;
+                        jpeg_transform_mcus(staging, stride, jpeg, x_first, x_done - x_first, mcu_coefs);
+                    }
+                    coefs = mcu_coefs + (x_unit - x_first) * jpeg->sampling->blocks;
+                }
+                if (jpeg->pass != PASS_CACHE)
+                {
+                    jpeg_code_mcu(jpeg, coefs, prev_dc);
+                }
+            }
+            if (x_unit == jpeg->x_unit_count - 1)
+            {
+                jpeg_flush(jpeg);
+                stats_lap(jpeg, WSJPEG_STAGE_WRITE);
+            }
+        }
+        if (jpeg->pass == PASS_ENCODE || jpeg->pass == PASS_REPLAY)
+        {
+            huffman_finish(jpeg);
+            if (mcu_end < mcu_count)
+            {
+                jpeg_put_rst(jpeg, first);
+            }
+            stats_lap(jpeg, WSJPEG_STAGE_HUFFMAN);
+        }
+    }
+    if (staging != NULL)
+    {
+        mem_free(jpeg->context, staging);
+    }
+}
+
+void *jpeg_worker_run(void *arg)
+{
+    pWORKER worker = arg;
+
+    if (setjmp(worker->context.jump) == 0)
+    {
+        if (worker->jpeg.pass != PASS_GATHER)
+        {
+            worker->jpeg.data = mem_alloc(&worker->context, worker->jpeg.capacity);
+        }
+        jpeg_encode_intervals(worker->bitmap, &worker->jpeg, worker->first, worker->last);
+    }
+    return NULL;
+}
+
+void jpeg_run_workers(pJPEG jpeg, pWORKER workers, int threads, void *(*run)(void *))
+{
+    int i, error = WSJPEG_OK;
+#ifdef USE_PTHREAD
+    pthread_t *handles;
+    int created;
+
+    handles = mem_alloc(jpeg->context, threads * sizeof(pthread_t));
+    for (created = 1; created < threads; created++)
+    {
+        if (pthread_create(&handles[created], NULL, run, &workers[created]) != 0)
+        {
+            error = WSJPEG_ERROR_THREAD;
+            break;
+        }
+    }
+    if (error == WSJPEG_OK)
+    {
+        run(&workers[0]);
+    }
+    for (i = 1; i < created; i++)
+    {
+        pthread_join(handles[i], NULL);
+    }
+    mem_free(jpeg->context, handles);
+#else
+    for (i = 0; i < threads; i++)
+    {
+        run(&workers[i]);
+    }
+#endif
+
+    /* from here on, errors of the workers are errors of the encoder */
+    for (i = 0; i < threads; i++)
+    {
+        mem_adopt(jpeg->context, &workers[i].context);
+        if (error == WSJPEG_OK)
+        {
+            error = workers[i].context.error;
+        }
+    }
+    if (error != WSJPEG_OK)
+    {
+        error_raise(jpeg->context, error);
+    }
+}
+
+void jpeg_encode_parallel(pBITMAP bitmap, pJPEG jpeg, UINT32 interval_count, int threads)
+{
+    pWORKER workers;
+    UINT32 interval, mcu_count, mcu_first, mcu_last;
+    int i, h, k;
+
+    workers = mem_alloc(jpeg->context, threads * sizeof(WORKER));
+    mcu_count = jpeg->x_unit_count * jpeg->y_unit_count;
+    interval = jpeg->restart_interval;
+
+    /*
+     * Every worker gets a contiguous range of restart intervals
+     * and codes it into a private buffer. The intervals do not
+     * depend on each other, so the buffers are simply joined in
+     * order afterwards.
+     */
+    for (i = 0; i < threads; i++)
+    {
+        context_init(&workers[i].context, &jpeg->context->allocator);
+        workers[i].bitmap = bitmap;
+        workers[i].jpeg = *jpeg;
+        workers[i].jpeg.context = &workers[i].context;
+        workers[i].jpeg.stats = (jpeg->stats != NULL) ? &workers[i].stats : NULL;
+        memset(&workers[i].stats, 0, sizeof(STATS));
+        workers[i].jpeg.write = NULL;
+        workers[i].jpeg.data = NULL;
+        workers[i].jpeg.size = 0;
+        workers[i].jpeg.coefs = NULL;
+        workers[i].jpeg.coefs_capacity = 0;
+        workers[i].jpeg.cache = NULL;
+        workers[i].jpeg.cache_capacity = 0;
+        workers[i].first = (UINT32) ((double) interval_count * i / threads);
+        workers[i].last  = (UINT32) ((double) interval_count * (i + 1) / threads);
+        mcu_first = workers[i].first * interval;
+        mcu_last = (mcu_count - mcu_first > (workers[i].last - workers[i].first) * interval) ?
+                   workers[i].last * interval : mcu_count;
+        workers[i].jpeg.capacity = jpeg_scan_bound(jpeg->mcu_bound, mcu_last - mcu_first,
+                                                   workers[i].last - workers[i].first);
+    }
+    jpeg_run_workers(jpeg, workers, threads, jpeg_worker_run);
+
+    /*
+     * Optimized tables need the counts of the whole image. The
+     * workers only gathered them, so sum them up, build the
+     * tables and let the workers code what they kept.
+     */
+    if (jpeg->pass == PASS_GATHER)
+    {
+        for (i = 0; i < threads; i++)
+        {
+            for (h = 0; h < 4; h++)
+            {
+                for (k = 0; k < 256; k++)
+                {
+                    jpeg->freq[h][k] += workers[i].jpeg.freq[h][k];
+                }
+            }
+        }
+        huffman_optimize(jpeg);
+        jpeg_put_header(jpeg);
+        jpeg_flush(jpeg);
+        for (i = 0; i < threads; i++)
+        {
+            memcpy(workers[i].jpeg.huff_table, jpeg->huff_table, sizeof(jpeg->huff_table));
+            memcpy(workers[i].jpeg.dc_code, jpeg->dc_code, sizeof(jpeg->dc_code));
+            memcpy(workers[i].jpeg.ac_code, jpeg->ac_code, sizeof(jpeg->ac_code));
+            workers[i].jpeg.pass = PASS_REPLAY;
+            workers[i].jpeg.coefs_read = 0;
+        }
+        jpeg_run_workers(jpeg, workers, threads, jpeg_worker_run);
+    }
+
+#ifdef USE_STATS
+    if (jpeg->stats != NULL)
+    {
+        for (i = 0; i < threads; i++)
+        {
+            stats_add(jpeg->stats, &workers[i].stats);
+        }
+    }
+#endif
+    stats_lap(jpeg, -1);
+    for (i = 0; i < threads; i++)
+    {
+        if (jpeg->write != NULL)
+        {
+            /* hand the private buffer to the output as it is */
+            jpeg_flush(jpeg);
+            workers[i].jpeg.context = jpeg->context;
+            workers[i].jpeg.stats = jpeg->stats;
+            workers[i].jpeg.write = jpeg->write;
+            workers[i].jpeg.opaque = jpeg->opaque;
+            jpeg_flush(&workers[i].jpeg);
+        }
+        else
+        {
+            jpeg_reserve(jpeg, workers[i].jpeg.size);
+            memcpy(jpeg->data + jpeg->size, workers[i].jpeg.data, workers[i].jpeg.size);
+            jpeg->size += workers[i].jpeg.size;
+        }
+        mem_free(jpeg->context, workers[i].jpeg.data);
+        if (workers[i].jpeg.coefs != NULL)
+        {
+            mem_free(jpeg->context, workers[i].jpeg.coefs);
+        }
+    }
+    stats_lap(jpeg, WSJPEG_STAGE_WRITE);
+    mem_free(jpeg->context, workers);
+}
+
+#ifdef USE_PTHREAD
+void jpeg_pipe_stop(pPIPE pipe, int error)
+{
+    pthread_mutex_lock(&pipe->lock);
+    if (pipe->error == WSJPEG_OK)
+    {
+        pipe->error = error;
+    }
+    pthread_cond_broadcast(&pipe->ready);
+    pthread_cond_broadcast(&pipe->free);
+    pthread_mutex_unlock(&pipe->lock);
+}
+
+void *jpeg_pipe_run(void *arg)
+{
+    /* transforms rows of MCUs into the ring until every row is taken */
+    pWORKER worker = arg;
+    pPIPE pipe = worker->pipe;
+    pJPEG jpeg = &worker->jpeg;
+    BYTE *volatile staging = NULL;
+    BLOCK *blocks;
+    SIZE_T stride;
+    UINT32 row, x_unit;
+    UINT32 mcu_width = jpeg->sampling->mcu_width, mcu_height = jpeg->sampling->mcu_height;
+    int mcu_blocks = jpeg->sampling->blocks, group = MCU_GROUP_BLOCKS / mcu_blocks, count;
+
+    if (setjmp(worker->context.jump) != 0)
+    {
+        jpeg_pipe_stop(pipe, worker->context.error);
+        if (staging != NULL)
+        {
+            mem_free(&worker->context, staging);
+        }
+        return NULL;
+    }
+    stride = jpeg->x_unit_count * mcu_width * 3;
+    staging = mem_alloc(&worker->context, mcu_height * stride + 1);
+    for (;;)
+    {
+        pthread_mutex_lock(&pipe->lock);
+        while (pipe->error == WSJPEG_OK && pipe->next < jpeg->y_unit_count &&
+               pipe->next >= pipe->done + pipe->slot_count)
+        {
+            pthread_cond_wait(&pipe->free, &pipe->lock);
+        }
+        if (pipe->error != WSJPEG_OK || pipe->next >= jpeg->y_unit_count)
+        {
+            pthread_mutex_unlock(&pipe->lock);
+            break;
+        }
+        row = pipe->next++;
+        pthread_mutex_unlock(&pipe->lock);
+
+        stats_lap(jpeg, -1);
+        bitmap_prefetch(worker->bitmap, (row + 1) * mcu_height, mcu_height);
+        bitmap_get_rows(worker->bitmap, row * mcu_height, mcu_height, jpeg->x_unit_count * mcu_width, staging);
+        stats_lap(jpeg, WSJPEG_STAGE_READ);
+        blocks = pipe->blocks + (SIZE_T) (row % pipe->slot_count) * jpeg->x_unit_count * mcu_blocks;
+        for (x_unit = 0; x_unit < jpeg->x_unit_count; x_unit += count)
+        {
+            count = (jpeg->x_unit_count - x_unit > (UINT32) group) ? group : (int) (jpeg->x_unit_count - x_unit);
+            jpeg_transform_mcus(staging, stride, jpeg, x_unit, count, blocks + x_unit * mcu_blocks);
+        }
+
+        pthread_mutex_lock(&pipe->lock);
+        pipe->slot_row[row % pipe->slot_count] = row;
+        pthread_cond_broadcast(&pipe->ready);
+        pthread_mutex_unlock(&pipe->lock);
+    }
+    mem_free(&worker->context, staging);
+    return NULL;
+}
+
+void jpeg_encode_pipelined(pBITMAP bitmap, pJPEG jpeg, UINT32 interval_count, int threads)
+{
+    /*
+     * The scan is coded in order on this thread, as if it was
+     * serial, while the other threads read, convert, transform
+     * and quantize the rows ahead of it. Nothing in the output
+     * changes, not even the restart markers.
+     */
+    PIPE pipe;
+    pWORKER workers;
+    pthread_t *handles;
+    jmp_buf jump;
+    UINT32 i;
+    int created, error;
+
+    /* one thread codes, the others transform, at most one row each */
+    threads--;
+    if ((UINT32) threads > jpeg->y_unit_count)
+    {
+        threads = jpeg->y_unit_count;
+    }
+    pipe.slot_count = threads + 2;
+    pipe.blocks = mem_alloc(jpeg->context, (SIZE_T) pipe.slot_count * jpeg->x_unit_count *
+                                           jpeg->sampling->blocks * sizeof(BLOCK));
+    pipe.slot_row = mem_alloc(jpeg->context, pipe.slot_count * sizeof(UINT32));
+    for (i = 0; i < pipe.slot_count; i++)
+    {
+        pipe.slot_row[i] = PIPE_EMPTY;
+    }
+    pipe.next = pipe.done = 0;
+    pipe.error = WSJPEG_OK;
+    workers = mem_alloc(jpeg->context, threads * sizeof(WORKER));
+    handles = mem_alloc(jpeg->context, threads * sizeof(pthread_t));
+    pthread_mutex_init(&pipe.lock, NULL);
+    pthread_cond_init(&pipe.ready, NULL);
+    pthread_cond_init(&pipe.free, NULL);
+
+    for (created = 0; created < threads; created++)
+    {
+        context_init(&workers[created].context, &jpeg->context->allocator);
+        workers[created].bitmap = bitmap;
+        workers[created].jpeg = *jpeg;
+        workers[created].jpeg.context = &workers[created].context;
+        workers[created].jpeg.stats = (jpeg->stats != NULL) ? &workers[created].stats : NULL;
+        memset(&workers[created].stats, 0, sizeof(STATS));
+        workers[created].pipe = &pipe;
+        if (pthread_create(&handles[created], NULL, jpeg_pipe_run, &workers[created]) != 0)
+        {
+            jpeg_pipe_stop(&pipe, WSJPEG_ERROR_THREAD);
+            break;
+        }
+    }
+
+    /* errors of the coder have to stop the other threads before they are raised */
+    memcpy(jump, jpeg->context->jump, sizeof(jmp_buf));
+    if (setjmp(jpeg->context->jump) == 0)
+    {
+        jpeg->pipe = &pipe;
+        jpeg_encode_intervals(bitmap, jpeg, 0, interval_count);
+        error = WSJPEG_OK;
+    }
+    else
+    {
+        error = jpeg->context->error;
+    }
+    memcpy(jpeg->context->jump, jump, sizeof(jmp_buf));
+    jpeg->pipe = NULL;
+    jpeg_pipe_stop(&pipe, error);
+    for (i = 0; i < (UINT32) created; i++)
+    {
+        pthread_join(handles[i], NULL);
+        mem_adopt(jpeg->context, &workers[i].context);
+#ifdef USE_STATS
+        if (jpeg->stats != NULL)
+        {
+            stats_add(jpeg->stats, &workers[i].stats);
+        }
+#endif
+    }
+    error = pipe.error;
+    pthread_cond_destroy(&pipe.free);
+    pthread_cond_destroy(&pipe.ready);
+    pthread_mutex_destroy(&pipe.lock);
+    mem_free(jpeg->context, handles);
+    mem_free(jpeg->context, workers);
+    mem_free(jpeg->context, pipe.slot_row);
+    mem_free(jpeg->context, pipe.blocks);
+    if (error != WSJPEG_OK)
+    {
+        error_raise(jpeg->context, error);
+    }
+}
+#endif
+
+void jpeg_encode_scan(pBITMAP bitmap, pJPEG jpeg, UINT32 interval_count, int threads)
+{
+    /* the whole scan in order, kept coefficients are only replayed */
+#ifdef USE_PTHREAD
+    if (threads > 1 && jpeg->pass != PASS_REPLAY)
+    {
+        jpeg_encode_pipelined(bitmap, jpeg, interval_count, threads);
+        return;
+    }
+#else
+    (void) threads;
+#endif
+    jpeg_encode_intervals(bitmap, jpeg, 0, interval_count);
+}
+
+double jpeg_probe(pJPEG jpeg, int quality, int optimize, SIZE_T header)
+{
+    /*
+     * Quantize the cached blocks with the tables of quality and
+     * count their symbols. Returns an estimate of the file size: the
+     * header bytes besides the symbols of its tables, those
+     * symbols, the coded bits of the scan, with its own tables
+     * when optimize is set, and the markers. Stuffed and padding
+     * bytes are left out.
+     */
+    UINT32 freq[257], mcu, mcu_count, interval;
+    UINT8 lengths[256];
+    HUFFMAN huff;
+    BLOCK coefs[6];
+    double bits = 0;
+    int prev_dc[3], comp, a, t, i, symbols = 0;
+
+    dct_init(quality, jpeg);
+    memset(jpeg->freq, 0, sizeof(jpeg->freq));
+    jpeg->cache_read = 0;
+    mcu_count = jpeg->x_unit_count * jpeg->y_unit_count;
+    interval = (jpeg->restart_interval != 0) ? jpeg->restart_interval : mcu_count;
+
+    stats_lap(jpeg, -1);
+    for (mcu = 0; mcu < mcu_count; mcu++)
+    {
+        if (mcu % interval == 0)
+        {
+            prev_dc[0] = prev_dc[1] = prev_dc[2] = 0;
+        }
+        jpeg_quantize_cached(jpeg, coefs);
+        for (a = 0; a < jpeg->sampling->blocks; a++)
+        {
+            comp = jpeg->sampling->block_comp[a];
+            huffman_count(&coefs[a], comp, prev_dc[comp], jpeg);
+            prev_dc[comp] = coefs[a].coef[0];
+        }
+        stats_lap(jpeg, WSJPEG_STAGE_HUFFMAN);
+    }
+
+    /* every symbol is its code followed by as many bits as its low nibble says */
+    for (t = 0; t < 2 * jpeg->sampling->comps && t < 4; t++)
+    {
+        if (optimize)
+        {
+            memcpy(freq, jpeg->freq[t], sizeof(freq));
+            huffman_build_table(freq, &huff);
+            huffman_code_lengths(&huff, lengths);
+        }
+        else
+        {
+            huffman_code_lengths(&jpeg->huff[t], lengths);
+        }
+        for (i = 0; i < 256; i++)
+        {
+            bits += (double) jpeg->freq[t][i] * (lengths[i] + (i & 15));
+            symbols += (lengths[i] != 0);
+        }
+    }
+    stats_lap(jpeg, WSJPEG_STAGE_HUFFMAN);
+
+    return header + symbols + bits / 8 +
+           2.0 * jpeg_interval_count(mcu_count, jpeg->restart_interval) + 2;
+}
+
+int capped_write(void *opaque, const void *data, size_t size)
+{
+    /* keeps the output in memory, but only counts what goes past the limit */
+    pCAPPED capped = opaque;
+    SIZE_T capacity;
+
+    if (capped->size <= capped->limit && size <= capped->limit - capped->size)
+    {
+        if (capped->capacity - capped->size < size)
+        {
+            capacity = (capped->capacity == 0) ? 65536 : capped->capacity * 2;
+            while (capacity - capped->size < size)
+            {
+                capacity *= 2;
+            }
+            capped->data = (capped->data == NULL) ? mem_alloc(capped->context, capacity) :
+                                                    mem_realloc(capped->context, capped->data, capacity);
+            capped->capacity = capacity;
+        }
+        memcpy(capped->data + capped->size, data, size);
+    }
+    capped->size += size;
+    return 0;
+}
+
+void jpeg_cache_image(pBITMAP bitmap, pJPEG jpeg, UINT32 interval_count)
+{
+    /* read and transform the whole image into the cache */
+    SIZE_T blocks;
+
+    blocks = (SIZE_T) jpeg->x_unit_count * jpeg->y_unit_count * jpeg->sampling->blocks;
+    if (jpeg->cache_capacity < blocks)
+    {
+        if (jpeg->cache != NULL)
+        {
+            mem_free(jpeg->context, jpeg->cache);
+            jpeg->cache = NULL;
+        }
+        jpeg->cache = mem_alloc(jpeg->context, blocks * sizeof(DCTBLOCK));
+        jpeg->cache_capacity = blocks;
+    }
+    jpeg->cache_size = 0;
+    jpeg->pass = PASS_CACHE;
+    jpeg_encode_intervals(bitmap, jpeg, 0, interval_count);
+}
+
+void jpeg_encode_cached(pBITMAP bitmap, pJPEG jpeg, UINT32 interval_count)
+{
+    /*
+     * The header and the scan of the cached blocks, quantized
+     * with the tables of jpeg. If jpeg->pass is PASS_GATHER, the
+     * blocks are counted first to build optimized tables. The
+     * caller adds the EOI marker.
+     */
+    jpeg->cached = 1;
+    if (jpeg->pass == PASS_GATHER)
+    {
+        memset(jpeg->freq, 0, sizeof(jpeg->freq));
+        jpeg->coefs_size = jpeg->coefs_read = 0;
+        jpeg->cache_read = 0;
+        jpeg_encode_intervals(bitmap, jpeg, 0, interval_count);
+        huffman_optimize(jpeg);
+        jpeg->pass = PASS_REPLAY;
+    }
+    jpeg->cache_read = 0;
+    jpeg_put_header(jpeg);
+    jpeg_flush(jpeg);
+    jpeg_encode_intervals(bitmap, jpeg, 0, interval_count);
+    jpeg->cached = 0;
+}
+
+void jpeg_encode_target(pBITMAP bitmap, pJPEG jpeg, pOPTIONS options, UINT32 interval_count)
+{
+    /*
+     * Code the highest quality up to options->quality whose file
+     * fits in options->target_size bytes. The image is read and
+     * transformed only once, every quality tried just quantizes
+     * and counts the cached blocks. The estimates leave out the
+     * stuffed bytes, so the chosen quality is coded into memory
+     * first and the next lower one is tried if it does not fit
+     * after all. Quality 1 is written even if it is too large.
+     * The caller adds the EOI marker.
+     */
+    CAPPED capped;
+    wsjpeg_write_fn write = jpeg->write;
+    void *opaque = jpeg->opaque;
+    SIZE_T header;
+    int low = 1, high, quality, t, i;
+#ifdef USE_STATS
+    STATS saved;
+#endif
+
+    /* the symbols of the tables are counted by jpeg_probe */
+    jpeg->size = 0;
+    jpeg_put_header(jpeg);
+    header = jpeg->size;
+    jpeg->size = 0;
+    for (t = 0; t < 2 * jpeg->sampling->comps && t < 4; t++)
+    {
+        for (i = 0; i < 16; i++)
+        {
+            header -= jpeg->huff[t].bits[i];
+        }
+    }
+
+    jpeg_cache_image(bitmap, jpeg, interval_count);
+
+    /* the estimates grow with the quality, nearly always */
+    high = (options->quality > low) ? options->quality : low;
+    while (low < high)
+    {
+        quality = (low + high + 1) / 2;
+        if (jpeg_probe(jpeg, quality, options->optimize_huffman, header) <= (double) options->target_size)
+        {
+            low = quality;
+        }
+        else
+        {
+            high = quality - 1;
+        }
+    }
+
+    capped.context = jpeg->context;
+    capped.data = NULL;
+    capped.capacity = 0;
+    capped.limit = options->target_size;
+    for (quality = low; ; quality--)
+    {
+#ifdef USE_STATS
+        if (jpeg->stats != NULL)
+        {
+            saved = *jpeg->stats;
+        }
+#endif
+        dct_init(quality, jpeg);
+        capped.size = 0;
+        jpeg->write = (quality > 1) ? capped_write : write;
+        jpeg->opaque = (quality > 1) ? (void *) &capped : opaque;
+        jpeg->pass = options->optimize_huffman ? PASS_GATHER : PASS_ENCODE;
+        jpeg->size = 0;
+        jpeg_encode_cached(bitmap, jpeg, interval_count);
+        jpeg_flush(jpeg);
+        jpeg->write = write;
+        jpeg->opaque = opaque;
+        if (quality == 1)
+        {
+            break;
+        }
+        if (capped.size + 2 <= capped.limit)
+        {
+            if (write(opaque, capped.data, capped.size) != 0)
+            {
+                error_raise(jpeg->context, WSJPEG_ERROR_WRITE);
+            }
+            break;
+        }
+#ifdef USE_STATS
+        if (jpeg->stats != NULL)
+        {
+            memcpy(saved.stage_seconds, jpeg->stats->stage_seconds, sizeof(saved.stage_seconds));
+            *jpeg->stats = saved;
+        }
+#endif
+    }
+    if (capped.data != NULL)
+    {
+        mem_free(jpeg->context, capped.data);
+    }
+}
+
+pJPEG jpeg_create(pCONTEXT context, pOPTIONS options)
+{
+    /*
+     * Everything that only depends on the options, so that an
+     * encoder can keep it for all the images it codes. Optimized
+     * tables are not known in advance, so their codes count as
+     * 16 bits in the bound. The SIMD level of the options must
+     * pass simd_resolve.
+     */
+    pJPEG jpeg;
+
+    jpeg = mem_alloc(context, sizeof(JPEG));
+    jpeg->context = context;
+    jpeg->dct_method = options->dct_method;
+    jpeg->color_method = options->color_method;
+    if (jpeg->color_method == COLOR_INTEGER)
+    {
+        color_init_int(jpeg->color_table);
+    }
+    jpeg->data = NULL;
+    jpeg->capacity = 0;
+    jpeg->coefs = NULL;
+    jpeg->coefs_capacity = 0;
+    jpeg->cache = NULL;
+    jpeg->cache_capacity = 0;
+    jpeg->cached = 0;
+    jpeg->pipe = NULL;
+    jpeg->sampling = &SAMPLINGS[options->sampling];
+    jpeg->kernels = SIMD_KERNELS[simd_resolve(options->simd)];
+    jpeg->gather = jpeg->kernels->gather[options->sampling];
+    memcpy(jpeg->huff, HUFF, sizeof(jpeg->huff));
+    huffman_init(jpeg);
+    dct_init(options->quality, jpeg);
+    jpeg->mcu_bound = jpeg_mcu_bound(jpeg->quant_luma, jpeg->quant_chroma,
+                                     options->optimize_huffman ? NULL : jpeg->huff, jpeg->sampling);
+    return jpeg;
+}
+
+void jpeg_start(pJPEG jpeg, pBITMAP bitmap, pOPTIONS options, wsjpeg_write_fn write, void *opaque, pSTATS stats)
+{
+    /* the state of a new image, and its size in MCUs */
+#ifdef USE_STATS
+    if (stats != NULL)
+    {
+        memset(stats, 0, sizeof(STATS));
+    }
+#endif
+
+    jpeg->width = labs(bitmap->width);
+    jpeg->height = labs(bitmap->height);
+    jpeg->size = 0;
+    jpeg->write = write;
+    jpeg->opaque = opaque;
+    jpeg->stats = stats;
+    jpeg->_buff = 0;
+    jpeg->_nvacant = BITBUF_SIZE;
+    memset(jpeg->freq, 0, sizeof(jpeg->freq));
+    jpeg->coefs_size = jpeg->coefs_read = 0;
+
+    /* the last image may have left its own tables behind */
+    if (options->optimize_huffman && memcmp(jpeg->huff, HUFF, sizeof(jpeg->huff)) != 0)
+    {
+        memcpy(jpeg->huff, HUFF, sizeof(jpeg->huff));
+        huffman_init(jpeg);
+    }
+
+    jpeg->x_unit_count = (jpeg->width  + jpeg->sampling->mcu_width  - 1) / jpeg->sampling->mcu_width;
+    jpeg->y_unit_count = (jpeg->height + jpeg->sampling->mcu_height - 1) / jpeg->sampling->mcu_height;
+}
+
+SIZE_T jpeg_row_capacity(SIZE_T mcu_bound, UINT32 x_unit_count)
+{
+    /* output buffer that is flushed after every row of MCUs, also holds the header */
+    SIZE_T capacity;
+
+    capacity = jpeg_scan_bound(mcu_bound, x_unit_count, x_unit_count) + 2;
+    return (capacity < JPEG_HEADER_SIZE + JPEG_SYMBOLS_MAX) ? JPEG_HEADER_SIZE + JPEG_SYMBOLS_MAX : capacity;
+}
+
+void jpeg_encode_bmp(pJPEG jpeg, pBITMAP bitmap, pOPTIONS options, wsjpeg_write_fn write, void *opaque, pSTATS stats)
+{
+    UINT32 mcu_count, interval_count;
+    SIZE_T capacity;
+    int threads, pipelined;
+#ifdef USE_STATS
+    double start = stats_clock();
+#endif
+
+    jpeg_start(jpeg, bitmap, options, write, opaque, stats);
+    mcu_count = jpeg->x_unit_count * jpeg->y_unit_count;
+
+    /*
+     * Restart intervals can be coded independently. When more
+     * than one thread is requested without an explicit interval,
+     * restart at every row of MCUs, unless the scan is pipelined
+     * instead. Bands of a streamed bitmap have to be read in
+     * order, so streaming is always serial, and so is coding
+     * for a target size.
+     */
+    threads = (bitmap->fp == NULL && options->threads > 1 && options->target_size == 0) ? options->threads : 1;
+    pipelined = (threads > 1 && options->pipeline);
+    jpeg->restart_interval = options->restart_interval;
+    jpeg->pass = options->optimize_huffman ? PASS_GATHER : PASS_ENCODE;
+    if (threads > 1 && !pipelined && jpeg->restart_interval == 0)
+    {
+        jpeg->restart_interval = jpeg->x_unit_count;
+    }
+    interval_count = jpeg_interval_count(mcu_count, jpeg->restart_interval);
+    if (!pipelined && (UINT32) threads > interval_count)
+    {
+        threads = interval_count;
+    }
+
+    /*
+     * The buffer is sized for the worst case, so that it never
+     * has to grow while coding. With an output it is flushed
+     * after every row of MCUs, so it only has to hold the
+     * header or one row. A buffer left by a larger image is
+     * used as it is.
+     */
+    if (write == NULL)
+    {
+        capacity = JPEG_HEADER_SIZE + JPEG_SYMBOLS_MAX +
+                   jpeg_scan_bound(jpeg->mcu_bound, mcu_count, interval_count) + 2;
+    }
+    else
+    {
+        capacity = jpeg_row_capacity(jpeg->mcu_bound, jpeg->x_unit_count);
+    }
+    if (jpeg->data == NULL || jpeg->capacity < capacity)
+    {
+        if (jpeg->data != NULL)
+        {
+            mem_free(jpeg->context, jpeg->data);
+            jpeg->data = NULL;
+        }
+        jpeg->data = mem_alloc(jpeg->context, capacity);
+        jpeg->capacity = capacity;
+    }
+
+    /*
+     * With optimized tables the image is quantized once to count
+     * the symbols and keep the coefficients, and the header can
+     * only be written after the tables have been built.
+     */
+    if (options->target_size != 0)
+    {
+        jpeg_encode_target(bitmap, jpeg, options, interval_count);
+    }
+    else if (threads > 1 && !pipelined)
+    {
+        if (jpeg->pass == PASS_ENCODE)
+        {
+            jpeg_put_header(jpeg);
+            jpeg_flush(jpeg);
+        }
+        jpeg_encode_parallel(bitmap, jpeg, interval_count, threads);
+    }
+    else
+    {
+        if (jpeg->pass == PASS_GATHER)
+        {
+            jpeg_encode_scan(bitmap, jpeg, interval_count, threads);
+            huffman_optimize(jpeg);
+            jpeg->pass = PASS_REPLAY;
+        }
+        jpeg_put_header(jpeg);
+        jpeg_flush(jpeg);
+        jpeg_encode_scan(bitmap, jpeg, interval_count, threads);
+    }
+    jpeg_put_eoi(jpeg);
+    jpeg_flush(jpeg);
+#ifdef USE_STATS
+    if (stats != NULL)
+    {
+        stats->seconds = stats_clock() - start;
+    }
+#endif
+}
+
+void *jpeg_output_run(void *arg)
+{
+    /* a whole file of jpeg_encode_multi */
+    pWORKER worker = arg;
+
+    if (setjmp(worker->context.jump) == 0)
+    {
+        worker->jpeg.data = mem_alloc(&worker->context, worker->jpeg.capacity);
+        jpeg_encode_cached(worker->bitmap, &worker->jpeg, worker->last);
+        jpeg_put_eoi(&worker->jpeg);
+        jpeg_flush(&worker->jpeg);
+    }
+    return NULL;
+}
+
+void jpeg_encode_multi(pJPEG jpeg, pBITMAP bitmap, pOPTIONS options, const wsjpeg_output *outputs, int count, pSTATS stats)
+{
+    /*
+     * One file for each output, all from a single read and DCT
+     * of the image. The blocks are cached, and every output is
+     * a worker that quantizes and codes them with the tables of
+     * its own quality. Up to options->threads of them run at a
+     * time, each flushing to its own output.
+     */
+    pWORKER workers;
+    UINT32 mcu_count, interval_count;
+    int i, n;
+#ifdef USE_STATS
+    double start = stats_clock();
+#endif
+
+    jpeg_start(jpeg, bitmap, options, NULL, NULL, stats);
+    mcu_count = jpeg->x_unit_count * jpeg->y_unit_count;
+    jpeg->restart_interval = options->restart_interval;
+    interval_count = jpeg_interval_count(mcu_count, jpeg->restart_interval);
+    jpeg_cache_image(bitmap, jpeg, interval_count);
+
+    workers = mem_alloc(jpeg->context, count * sizeof(WORKER));
+    for (i = 0; i < count; i++)
+    {
+        context_init(&workers[i].context, &jpeg->context->allocator);
+        workers[i].bitmap = bitmap;
+        workers[i].jpeg = *jpeg;
+        workers[i].jpeg.context = &workers[i].context;
+        workers[i].jpeg.stats = (jpeg->stats != NULL) ? &workers[i].stats : NULL;
+        memset(&workers[i].stats, 0, sizeof(STATS));
+        workers[i].jpeg.write = outputs[i].write;
+        workers[i].jpeg.opaque = outputs[i].opaque;
+        workers[i].jpeg.data = NULL;
+        workers[i].jpeg.coefs = NULL;
+        workers[i].jpeg.coefs_capacity = 0;
+        workers[i].jpeg.cache_capacity = 0;           /* shared, not its own */
+        workers[i].jpeg.pass = options->optimize_huffman ? PASS_GATHER : PASS_ENCODE;
+        workers[i].first = 0;
+        workers[i].last = interval_count;
+        dct_init(outputs[i].quality, &workers[i].jpeg);
+        workers[i].jpeg.mcu_bound = jpeg_mcu_bound(workers[i].jpeg.quant_luma, workers[i].jpeg.quant_chroma,
+                                                   options->optimize_huffman ? NULL : jpeg->huff, jpeg->sampling);
+        workers[i].jpeg.capacity = jpeg_row_capacity(workers[i].jpeg.mcu_bound, jpeg->x_unit_count);
+    }
+    for (i = 0; i < count; i += n)
+    {
+        n = (count - i < options->threads) ? count - i : options->threads;
+        jpeg_run_workers(jpeg, workers + i, n, jpeg_output_run);
+    }
+
+    for (i = 0; i < count; i++)
+    {
+#ifdef USE_STATS
+        if (jpeg->stats != NULL)
+        {
+            stats_add(jpeg->stats, &workers[i].stats);
+        }
+#endif
+        mem_free(jpeg->context, workers[i].jpeg.data);
+        if (workers[i].jpeg.coefs != NULL)
+        {
+            mem_free(jpeg->context, workers[i].jpeg.coefs);
+        }
+    }
+    mem_free(jpeg->context, workers);
+#ifdef USE_STATS
+    if (stats != NULL)
+    {
+        stats->seconds = stats_clock() - start;
+    }
+#endif
+}
+
+void jpeg_free(pJPEG jpeg)
+{
+    if (jpeg->coefs != NULL)
+    {
+        mem_free(jpeg->context, jpeg->coefs);
+    }
+    if (jpeg->cache != NULL)
+    {
+        mem_free(jpeg->context, jpeg->cache);
+    }
+    if (jpeg->data != NULL)
+    {
+        mem_free(jpeg->context, jpeg->data);
+    }
+    mem_free(jpeg->context, jpeg);
+}
+
+void wsjpeg_default_options(wsjpeg_options *options)
+{
+    options->quality = 75;
+    options->restart_interval = 0;
+    options->threads = 1;
+    options->dct_method = DCT_DEFAULT;
+    options->optimize_huffman = 0;
+    options->pipeline = 0;
+    options->sampling = WSJPEG_SAMPLING_420;
+    options->target_size = 0;
+    options->color_method = COLOR_DEFAULT;
+    options->simd = WSJPEG_SIMD_AUTO;
+}
+
+int options_valid(const OPTIONS *options)
+{
+    /* whether every option is within its range, the SIMD level not yet resolved */
+    return options->quality >= 0 && options->quality <= 100 && options->threads >= 1 && options->threads <= 256 &&
+           (options->dct_method == DCT_FLOAT || options->dct_method == DCT_INTEGER) &&
+           (options->color_method == COLOR_FLOAT || options->color_method == COLOR_INTEGER) &&
+           options->sampling >= 0 && options->sampling < SAMPLING_COUNT && options->simd >= 0 && options->simd < SIMD_COUNT;
+}
+
+int wsjpeg_encoder_create(wsjpeg_encoder **encoder, const wsjpeg_options *options,
+                          const wsjpeg_allocator *allocator)
+{
+    wsjpeg_encoder *enc;
+    CONTEXT context;
+    OPTIONS opts;
+
+    *encoder = NULL;
+    context_init(&context, allocator);
+    if (options != NULL)
+    {
+        opts = *options;
+    }
+    else
+    {
+        wsjpeg_default_options(&opts);
+    }
+    if (!options_valid(&opts))
+    {
+        return WSJPEG_ERROR_ARGUMENT;
+    }
+    if ((opts.simd = simd_resolve(opts.simd)) < 0)
+    {
+        return WSJPEG_ERROR_UNSUPPORTED;
+    }
+
+    /* the encoder itself is not tracked by its context */
+    if ((enc = context.allocator.malloc_fn(context.allocator.opaque, sizeof(wsjpeg_encoder))) == NULL)
+    {
+        return WSJPEG_ERROR_MEMORY;
+    }
+    context_init(&enc->context, &context.allocator);
+    enc->options = opts;
+    enc->jpeg = NULL;
+    enc->bitmap = NULL;
+    memset(&enc->stats, 0, sizeof(STATS));
+    *encoder = enc;
+    return WSJPEG_OK;
+}
+
+int encoder_run(wsjpeg_encoder *encoder, void (*fn)(wsjpeg_encoder *encoder, void *arg), void *arg)
+{
+    /*
+     * Call fn, which opens encoder->bitmap and encodes it with
+     * encoder->jpeg, and catch its errors. The kept state may be
+     * half updated after an error, so it is dropped and built
+     * again by the next call.
+     */
+    pCONTEXT context = &encoder->context;
+
+    context->error = WSJPEG_OK;
+    encoder->bitmap = NULL;
+    if (setjmp(context->jump) != 0)
+    {
+        if (encoder->bitmap != NULL)
+        {
+            bitmap_free(encoder->bitmap);
+            encoder->bitmap = NULL;
+        }
+        mem_free_all(context);
+        encoder->jpeg = NULL;
+        return context->error;
+    }
+    if (encoder->jpeg == NULL)
+    {
+        encoder->jpeg = jpeg_create(context, &encoder->options);
+    }
+    fn(encoder, arg);
+    bitmap_free(encoder->bitmap);
+    encoder->bitmap = NULL;
+    return WSJPEG_OK;
+}
+
+void encoder_encode(wsjpeg_encoder *encoder, void *arg)
+{
+    /* the body of the wsjpeg_encode_* functions */
+    pREQUEST request = arg;
+
+    if (request->pixels != NULL)
+    {
+        encoder->bitmap = bitmap_open_rgb(&encoder->context, request->pixels, request->width, request->height,
+                                          request->stride);
+    }
+    else
+    {
+        encoder->bitmap = bitmap_open_memory(&encoder->context, request->bmp, request->size);
+    }
+    if (request->outputs != NULL)
+    {
+        jpeg_encode_multi(encoder->jpeg, encoder->bitmap, &encoder->options, request->outputs, request->count,
+                          &encoder->stats);
+    }
+    else
+    {
+        jpeg_encode_bmp(encoder->jpeg, encoder->bitmap, &encoder->options, request->write, request->opaque,
+                        &encoder->stats);
+    }
+}
+
+int wsjpeg_encode_rgb(wsjpeg_encoder *encoder, const unsigned char *pixels,
+                      unsigned width, unsigned height, size_t stride,
+                      wsjpeg_write_fn write, void *opaque)
+{
+    REQUEST request;
+
+    if (write == NULL || pixels == NULL || width == 0 || height == 0 || stride < (size_t) width * 3)
+    {
+        return WSJPEG_ERROR_ARGUMENT;
+    }
+    memset(&request, 0, sizeof(REQUEST));
+    request.pixels = pixels;
+    request.width = width;
+    request.height = height;
+    request.stride = stride;
+    request.write = write;
+    request.opaque = opaque;
+    return encoder_run(encoder, encoder_encode, &request);
+}
+
+int wsjpeg_encode_bmp_memory(wsjpeg_encoder *encoder, const void *bmp, size_t size,
+                             wsjpeg_write_fn write, void *opaque)
+{
+    REQUEST request;
+
+    if (write == NULL || bmp == NULL)
+    {
+        return WSJPEG_ERROR_ARGUMENT;
+    }
+    memset(&request, 0, sizeof(REQUEST));
+    request.bmp = bmp;
+    request.size = size;
+    request.write = write;
+    request.opaque = opaque;
+    return encoder_run(encoder, encoder_encode, &request);
+}
+
+int encoder_check_outputs(wsjpeg_encoder *encoder, const wsjpeg_output *outputs, int count)
+{
+    int i;
+
+    if (outputs == NULL || count < 1 || encoder->options.target_size != 0)
+    {
+        return WSJPEG_ERROR_ARGUMENT;
+    }
+    for (i = 0; i < count; i++)
+    {
+        if (outputs[i].write == NULL || outputs[i].quality < 0 || outputs[i].quality > 100)
+        {
+            return WSJPEG_ERROR_ARGUMENT;
+        }
+    }
+    return WSJPEG_OK;
+}
+
+int wsjpeg_encode_rgb_multi(wsjpeg_encoder *encoder, const unsigned char *pixels,
+                            unsigned width, unsigned height, size_t stride,
+                            const wsjpeg_output *outputs, int count)
+{
+    REQUEST request;
+
+    if (encoder_check_outputs(encoder, outputs, count) != WSJPEG_OK ||
+        pixels == NULL || width == 0 || height == 0 || stride < (size_t) width * 3)
+    {
+        return WSJPEG_ERROR_ARGUMENT;
+    }
+    memset(&request, 0, sizeof(REQUEST));
+    request.pixels = pixels;
+    request.width = width;
+    request.height = height;
+    request.stride = stride;
+    request.outputs = outputs;
+    request.count = count;
+    return encoder_run(encoder, encoder_encode, &request);
+}
+
+int wsjpeg_encode_bmp_memory_multi(wsjpeg_encoder *encoder, const void *bmp, size_t size,
+                                   const wsjpeg_output *outputs, int count)
+{
+    REQUEST request;
+
+    if (encoder_check_outputs(encoder, outputs, count) != WSJPEG_OK || bmp == NULL)
+    {
+        return WSJPEG_ERROR_ARGUMENT;
+    }
+    memset(&request, 0, sizeof(REQUEST));
+    request.bmp = bmp;
+    request.size = size;
+    request.outputs = outputs;
+    request.count = count;
+    return encoder_run(encoder, encoder_encode, &request);
+}
+
+size_t wsjpeg_max_output_size(const wsjpeg_options *options, unsigned width, unsigned height)
+{
+    OPTIONS opts;
+    UINT8 quant_luma[8][8], quant_chroma[8][8];
+    UINT32 x_unit_count, mcu_count, symbols;
+    const SAMPLING *sampling;
+    SIZE_T scan;
+    UINT16 restart_interval;
+    int i, j;
+
+    if (options != NULL)
+    {
+        opts = *options;
+    }
+    else
+    {
+        wsjpeg_default_options(&opts);
+    }
+    if (width == 0 || height == 0 || width > 65535 || height > 65535 || !options_valid(&opts))
+    {
+        return 0;
+    }
+
+    /* the same intervals jpeg_encode_bmp would choose for these options */
+    sampling = &SAMPLINGS[opts.sampling];
+    x_unit_count = (width + sampling->mcu_width - 1) / sampling->mcu_width;
+    mcu_count = x_unit_count * ((height + sampling->mcu_height - 1) / sampling->mcu_height);
+    restart_interval = opts.restart_interval;
+    if (opts.threads > 1 && !opts.pipeline && restart_interval == 0)
+    {
+        restart_interval = x_unit_count;
+    }
+
+    dct_quant_tables(opts.quality, quant_luma, quant_chroma);
+    symbols = 0;
+    for (i = 0; i < 4; i++)
+    {
+        for (j = 0; j < 16; j++)
+        {
+            symbols += HUFF[i].bits[j];
+        }
+    }
+    if (opts.optimize_huffman)
+    {
+        symbols = JPEG_SYMBOLS_MAX;
+    }
+    scan = jpeg_scan_bound(jpeg_mcu_bound(quant_luma, quant_chroma, opts.optimize_huffman ? NULL : HUFF, sampling),
+                           mcu_count, jpeg_interval_count(mcu_count, restart_interval));
+    if (scan > (SIZE_T) -1 - JPEG_HEADER_SIZE - symbols - 2)
+    {
+        return (SIZE_T) -1;
+    }
+    return JPEG_HEADER_SIZE + symbols + scan + 2;                           /* EOI */
+}
+
+int wsjpeg_encoder_stats(const wsjpeg_encoder *encoder, wsjpeg_stats *stats)
+{
+    if (encoder == NULL || stats == NULL)
+    {
+        return WSJPEG_ERROR_ARGUMENT;
+    }
+#ifdef USE_STATS
+    *stats = encoder->stats;
+    return WSJPEG_OK;
+#else
+    return WSJPEG_ERROR_UNSUPPORTED;
+#endif
+}
+
+void wsjpeg_encoder_destroy(wsjpeg_encoder *encoder)
+{
+    if (encoder != NULL)
+    {
+        mem_free_all(&encoder->context);
+        encoder->context.allocator.free_fn(encoder->context.allocator.opaque, encoder);
+    }
+}
+
+const char *wsjpeg_error_string(int error)
+{
+    switch (error)
+    {
+    case WSJPEG_OK:                     return "Success.";
+    case WSJPEG_ERROR_MEMORY:           return OUT_OF_MEMORY_ERROR;
+    case WSJPEG_ERROR_ARGUMENT:         return ARGUMENT_ERROR;
+    case WSJPEG_ERROR_BMP_INVALID:      return BMP_INVALID_ERROR;
+    case WSJPEG_ERROR_BMP_CORRUPT:      return BMP_CORRUPT_ERROR;
+    case WSJPEG_ERROR_BMP_NOT_24BIT:    return BMP_NOT_24BIT_ERROR;
+    case WSJPEG_ERROR_TOO_LARGE:        return TOO_LARGE_ERROR;
+    case WSJPEG_ERROR_WRITE:            return JPG_WRITE_ERROR;
+    case WSJPEG_ERROR_THREAD:           return THREAD_ERROR;
+    case WSJPEG_ERROR_UNSUPPORTED:      return UNSUPPORTED_ERROR;
+    default:                            return "Unknown error.";
+    }
+}
+
+#ifndef WSJPEG_NO_MAIN
+void error_exit(const char *message)
+{
+    fprintf(stderr, "Error: %s\n", message);
+    exit(EXIT_FAILURE);
+}
+
+int file_write(void *opaque, const void *data, size_t size)
+{
+    return fwrite(data, 1, size, (FILE *) opaque) < size;
+}
+
+#ifdef USE_STATS
+void stats_print(const STATS *stats, double pixels)
+{
+    const char *names[WSJPEG_STAGE_COUNT] = {"read", "color", "dct", "quantize", "huffman", "write"};
+    const char *comps[3] = {"Y", "Cb", "Cr"};
+    double blocks = (stats->blocks != 0) ? stats->blocks : 1;
+    int i;
+
+    fprintf(stderr, "stage        seconds\n");
+    for (i = 0; i < WSJPEG_STAGE_COUNT; i++)
+    {
+        fprintf(stderr, "%-12s %9.4f\n", names[i], stats->stage_seconds[i]);
+    }
+    fprintf(stderr, "%-12s %9.4f\n\n", "total", stats->seconds);
+    fprintf(stderr, "blocks                %lu\n", stats->blocks);
+    fprintf(stderr, "zero blocks           %lu (%.1f%%)\n", stats->zero_blocks, 100.0 * stats->zero_blocks / blocks);
+    fprintf(stderr, "skipped blocks        %lu (%.1f%%)\n", stats->skipped_blocks, 100.0 * stats->skipped_blocks / blocks);
+    fprintf(stderr, "nonzero per block     %.2f\n", stats->nonzero_coefs / blocks);
+    fprintf(stderr, "ZRL codes             %lu\n", stats->zrl_codes);
+    fprintf(stderr, "EOB codes             %lu\n", stats->eob_codes);
+    fprintf(stderr, "stuffed bytes         %lu\n", stats->stuffed_bytes);
+    fprintf(stderr, "reallocs              %lu\n", stats->reallocs);
+    for (i = 0; i < 3; i++)
+    {
+        fprintf(stderr, "%-2s bits              %.0f (%.3f per pixel)\n", comps[i], stats->bits[i],
+                stats->bits[i] / ((pixels != 0) ? pixels : 1));
+    }
+    fprintf(stderr, "bytes                 %.0f\n", stats->bytes);
+}
+#endif
+
+void encode_file(FILE *in_file, FILE *out_file, wsjpeg_output *outputs, int count,
+                 pOPTIONS options, int stream, pSTATS stats)
+{
+    /* with outputs, one file for each of them instead of out_file */
+    CONTEXT context;
+    pBITMAP bitmap;
+    pJPEG jpeg;
+
+    context_init(&context, NULL);
+    if (setjmp(context.jump) != 0)
+    {
+        error_exit(wsjpeg_error_string(context.error));
+    }
+    if (stream)
+    {
+        /* one row of MCUs at a time, they are at most 16 pixels high */
+        bitmap = bitmap_open_stream(&context, in_file, 16);
+    }
+    else
+    {
+        bitmap = NULL;
+#ifdef USE_MMAP
+        bitmap = bitmap_open_mapped(&context, in_file);
+#endif
+        if (bitmap == NULL)
+        {
+            bitmap = bitmap_read(&context, in_file);
+        }
+    }
+    jpeg = jpeg_create(&context, options);
+    if (outputs != NULL)
+    {
+        jpeg_encode_multi(jpeg, bitmap, options, outputs, count, stats);
+    }
+    else
+    {
+        jpeg_encode_bmp(jpeg, bitmap, options, file_write, out_file, stats);
+    }
+#ifdef USE_STATS
+    if (stats != NULL)
+    {
+        stats_print(stats, (double) jpeg->width * jpeg->height * (outputs != NULL ? count : 1));
+    }
+#endif
+    jpeg_free(jpeg);
+    bitmap_free(bitmap);
+}
+
+/*
+ * Batch mode. One process codes a whole list of images, so the
+ * tables and buffers of an encoder are set up once per worker
+ * and quality instead of once per image.
+ */
+#define BATCH_LINE_MAX          4096
+#define QUALITIES_MAX           16      /* files coded from one image by --qualities */
+
+typedef struct
+{
+    FILE           *list;           /* one job per line: INPUT OUTPUT [quality] */
+    OPTIONS         options;        /* of every job, the quality unless the job gives one */
+    int             stream;
+    pSTATS          stats;          /* summed over all jobs, NULL if not wanted */
+    double          pixels;
+    UINT32          line;           /* number of the last line read */
+    int             failed;         /* jobs that failed */
+#ifdef USE_PTHREAD
+    pthread_mutex_t lock;           /* guards everything above */
+#endif
+} BATCH, *pBATCH;
+
+void batch_lock(pBATCH batch)
+{
+#ifdef USE_PTHREAD
+    pthread_mutex_lock(&batch->lock);
+#else
+    (void) batch;
+#endif
+}
+
+void batch_unlock(pBATCH batch)
+{
+#ifdef USE_PTHREAD
+    pthread_mutex_unlock(&batch->lock);
+#else
+    (void) batch;
+#endif
+}
+
+void batch_fail(pBATCH batch, UINT32 line, const char *name, const char *message)
+{
+    batch_lock(batch);
+    if (name != NULL)
+    {
+        fprintf(stderr, "Error: line %lu: %s: %s\n", (unsigned long) line, name, message);
+    }
+    else
+    {
+        fprintf(stderr, "Error: line %lu: %s\n", (unsigned long) line, message);
+    }
+    batch->failed++;
+    batch_unlock(batch);
+}
+
+int batch_next(pBATCH batch, char line[BATCH_LINE_MAX], UINT32 *number)
+{
+    /* reads the next line, 0 at the end of the list, -1 if it is too long */
+    int c, result = 1;
+
+    batch_lock(batch);
+    if (fgets(line, BATCH_LINE_MAX, batch->list) == NULL)
+    {
+        result = 0;
+    }
+    else if (strchr(line, '\n') == NULL && !feof(batch->list))
+    {
+        while ((c = getc(batch->list)) != EOF && c != '\n')
+            ;
+        result = -1;
+    }
+    *number = ++batch->line;
+    batch_unlock(batch);
+    return result;
+}
+
+char *batch_field(char **cursor)
+{
+    /* the next field separated by blanks, NULL if there is none */
+    char *field, *p = *cursor;
+
+    while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')
+    {
+        p++;
+    }
+    if (*p == '\0')
+    {
+        *cursor = p;
+        return NULL;
+    }
+    field = p;
+    while (*p != '\0' && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n')
+    {
+        p++;
+    }
+    if (*p != '\0')
+    {
+        *p++ = '\0';
+    }
+    *cursor = p;
+    return field;
+}
+
+/* one image of batch_encode */
+typedef struct
+{
+    FILE            *in_file;
+    FILE            *out_file;
+    int             stream;
+    pSTATS          stats;
+} JOB, *pJOB;
+
+void batch_encode_job(wsjpeg_encoder *encoder, void *arg)
+{
+    pJOB job = arg;
+
+    if (job->stream)
+    {
+        encoder->bitmap = bitmap_open_stream(&encoder->context, job->in_file, 16);
+    }
+    else
+    {
+#ifdef USE_MMAP
+        encoder->bitmap = bitmap_open_mapped(&encoder->context, job->in_file);
+#endif
+        if (encoder->bitmap == NULL)
+        {
+            encoder->bitmap = bitmap_read(&encoder->context, job->in_file);
+        }
+    }
+    jpeg_encode_bmp(encoder->jpeg, encoder->bitmap, &encoder->options, file_write, job->out_file, job->stats);
+}
+
+int batch_encode(wsjpeg_encoder *encoder, FILE *in_file, FILE *out_file, int stream, pSTATS stats)
+{
+    JOB job;
+
+    job.in_file = in_file;
+    job.out_file = out_file;
+    job.stream = stream;
+    job.stats = stats;
+    return encoder_run(encoder, batch_encode_job, &job);
+}
+
+void *batch_worker(void *arg)
+{
+    pBATCH batch = arg;
+    wsjpeg_encoder *encoders[101];     /* one for every quality that came up */
+    OPTIONS options;
+    char line[BATCH_LINE_MAX], *cursor, *input, *output, *field, *end;
+    UINT32 number;
+    FILE *in_file, *out_file;
+    long quality;
+    int i, error, more;
+
+    memset(encoders, 0, sizeof(encoders));
+    while ((more = batch_next(batch, line, &number)) != 0)
+    {
+        if (more < 0)
+        {
+            batch_fail(batch, number, NULL, LIST_LONG_ERROR);
+            continue;
+        }
+        cursor = line;
+        input = batch_field(&cursor);
+        if (input == NULL || input[0] == '#')
+        {
+            continue;
+        }
+        output = batch_field(&cursor);
+        field = batch_field(&cursor);
+        quality = batch->options.quality;
+        if (field != NULL)
+        {
+            quality = strtol(field, &end, 10);
+            if (*end != '\0' || quality < 0 || quality > 100)
+            {
+                output = NULL;
+            }
+        }
+        if (output == NULL || batch_field(&cursor) != NULL)
+        {
+            batch_fail(batch, number, NULL, LIST_LINE_ERROR);
+            continue;
+        }
+
+        if (encoders[quality] == NULL)
+        {
+            options = batch->options;
+            options.quality = (int) quality;
+            options.threads = 1;
+            if ((error = wsjpeg_encoder_create(&encoders[quality], &options, NULL)) != WSJPEG_OK)
+            {
+                batch_fail(batch, number, input, wsjpeg_error_string(error));
+                continue;
+            }
+        }
+        if ((in_file = fopen(input, "rb")) == NULL)
+        {
+            batch_fail(batch, number, input, BMP_OPEN_ERROR);
+            continue;
+        }
+        if ((out_file = fopen(output, "wb")) == NULL)
+        {
+            fclose(in_file);
+            batch_fail(batch, number, output, JPG_OPEN_ERROR);
+            continue;
+        }
+        error = batch_encode(encoders[quality], in_file, out_file, batch->stream,
+                             (batch->stats != NULL) ? &encoders[quality]->stats : NULL);
+        fclose(in_file);
+        if (fclose(out_file) != 0 && error == WSJPEG_OK)
+        {
+            error = WSJPEG_ERROR_WRITE;
+        }
+        if (error != WSJPEG_OK)
+        {
+            /* no half written images */
+            remove(output);
+            batch_fail(batch, number, input, wsjpeg_error_string(error));
+        }
+#ifdef USE_STATS
+        else if (batch->stats != NULL)
+        {
+            batch_lock(batch);
+            stats_add(batch->stats, &encoders[quality]->stats);
+            batch->pixels += (double) encoders[quality]->jpeg->width * encoders[quality]->jpeg->height;
+            batch_unlock(batch);
+        }
+#endif
+    }
+    for (i = 0; i <= 100; i++)
+    {
+        wsjpeg_encoder_destroy(encoders[i]);
+    }
+    return NULL;
+}
+
+int batch_run(FILE *list, pOPTIONS options, int stream, pSTATS stats)
+{
+    /* codes every job of list on options->threads workers, returns the number that failed */
+    BATCH batch;
+#ifdef USE_PTHREAD
+    pthread_t handles[256];
+    int i, created;
+#endif
+#ifdef USE_STATS
+    double start = stats_clock();
+
+    if (stats != NULL)
+    {
+        memset(stats, 0, sizeof(STATS));
+    }
+#endif
+
+    batch.list = list;
+    batch.options = *options;
+    batch.stream = stream;
+    batch.stats = stats;
+    batch.pixels = 0;
+    batch.line = 0;
+    batch.failed = 0;
+#ifdef USE_PTHREAD
+    pthread_mutex_init(&batch.lock, NULL);
+    for (created = 1; created < options->threads; created++)
+    {
+        if (pthread_create(&handles[created], NULL, batch_worker, &batch) != 0)
+        {
+            break;
+        }
+    }
+    batch_worker(&batch);
+    for (i = 1; i < created; i++)
+    {
+        pthread_join(handles[i], NULL);
+    }
+    pthread_mutex_destroy(&batch.lock);
+#else
+    batch_worker(&batch);
+#endif
+
+#ifdef USE_STATS
+    if (stats != NULL)
+    {
+        stats->seconds = stats_clock() - start;
+        stats_print(stats, batch.pixels);
+    }
+#endif
+    return batch.failed;
+}
+
+void usage_exit(char *program, char *message)
+{
+    if (message != NULL)
+    {
+        fprintf(stderr, "%s\n\n", message);
+    }
+    fprintf(stderr, "Usage: %s [OPTIONS] INPUT.bmp OUTPUT.jpg [quality]\n"
+                    "       %s [OPTIONS] --batch LIST [quality]\n\n", program, program);
+    fputs("  --batch LIST     code each \"INPUT OUTPUT [quality]\" line of LIST, - is stdin\n"
+          "  --stream         encode band by band, memory usage depends on width only\n"
+          "  --restart N      insert a restart marker every N MCUs (1 - 65535)\n"
+          "  --threads N      code restart intervals or batch jobs on N threads (1 - 256)\n"
+          "  --target-size N  the highest quality (up to the one given) that fits in N bytes\n", stderr);
+    fputs("  --sampling MODE  chroma subsampling \"420\" (default), \"422\", \"444\" or \"gray\"\n"
+          "  --dct METHOD     \"float\" or \"int\" (fixed-point) forward DCT\n"
+          "  --color METHOD   \"float\" or \"int\" (lookup tables) color conversion\n"
+          "  --simd LEVEL     \"auto\" (default), \"none\", \"sse2\" or \"avx2\" kernels\n"
+          "  --optimize       build Huffman tables for the image, smaller but slower\n"
+          "  --pipeline       with --threads, code in order while the others transform\n", stderr);
+    fputs("  --qualities LIST one file per quality of LIST, like 50,75,90, from one DCT;\n"
+          "                   the %d in OUTPUT.jpg is replaced by the quality\n"
+          "  --stats          print the time of every stage and coding statistics\n", stderr);
+    exit(EXIT_FAILURE);
+}
+
+int parse_number(char *program, char *string, int min, int max, char *message)
+{
+    long value;
+    char *ptr;
+
+    if (string == NULL)
+    {
+        usage_exit(program, message);
+    }
+    value = strtol(string, &ptr, 10);
+    if (*string == '\0' || *ptr != '\0' || value < min || value > max)
+    {
+        usage_exit(program, message);
+    }
+    return (int) value;
+}
+
+void encode_qualities(FILE *in_file, char *pattern, const int *qualities, int count,
+                      pOPTIONS options, int stream, pSTATS stats)
+{
+    /* the %d of pattern is replaced by each quality */
+    wsjpeg_output outputs[QUALITIES_MAX];
+    char name[FILENAME_MAX], *mark = strstr(pattern, "%d");
+    int i;
+
+    for (i = 0; i < count; i++)
+    {
+        sprintf(name, "%.*s%d%s", (int) (mark - pattern), pattern, qualities[i], mark + 2);
+        outputs[i].quality = qualities[i];
+        outputs[i].write = file_write;
+        outputs[i].opaque = fopen(name, "wb");
+        if (outputs[i].opaque == NULL)
+        {
+            error_exit(JPG_OPEN_ERROR);
+        }
+    }
+
+    encode_file(in_file, NULL, outputs, count, options, stream, stats);
+
+    for (i = 0; i < count; i++)
+    {
+        if (fclose((FILE *) outputs[i].opaque) != 0)
+        {
+            error_exit(JPG_WRITE_ERROR);
+        }
+    }
+}
+
+int parse_qualities(char *program, char *string, int qualities[QUALITIES_MAX])
+{
+    /* a comma separated list of qualities, returns how many */
+    char *end;
+    long value;
+    int count = 0;
+
+    while (string != NULL && count < QUALITIES_MAX)
+    {
+        value = strtol(string, &end, 10);
+        if (end == string || value < 0 || value > 100 || (*end != ',' && *end != '\0'))
+        {
+            break;
+        }
+        qualities[count++] = (int) value;
+        if (*end == '\0')
+        {
+            return count;
+        }
+        string = end + 1;
+    }
+    usage_exit(program, "The qualities should be a list like 50,75,90 of at most 16 values between 0 and 100.");
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    OPTIONS options;
+    STATS stats;
+    int qualities[QUALITIES_MAX], count = 0;
+    int stream = 0, show_stats = 0;
+    int i, nargs = 0;
+    char *args[3], *list = NULL;
+    FILE *in_file, *out_file;
+
+    wsjpeg_default_options(&options);
+    for (i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--stream") == 0)
+        {
+            stream = 1;
+        }
+        else if (strcmp(argv[i], "--restart") == 0)
+        {
+            options.restart_interval = parse_number(argv[0], argv[++i], 1, 65535,
+                                                    "The restart interval should be between 1 and 65535.");
+        }
+        else if (strcmp(argv[i], "--threads") == 0)
+        {
+            options.threads = parse_number(argv[0], argv[++i], 1, 256,
+                                           "The number of threads should be between 1 and 256.");
+        }
+        else if (strcmp(argv[i], "--batch") == 0)
+        {
+            if ((list = argv[++i]) == NULL)
+            {
+                usage_exit(argv[0], "The batch mode needs a list of images.");
+            }
+        }
+        else if (strcmp(argv[i], "--optimize") == 0)
+        {
+            options.optimize_huffman = 1;
+        }
+        else if (strcmp(argv[i], "--sampling") == 0)
+        {
+            if (++i < argc && strcmp(argv[i], "420") == 0)
+            {
+                options.sampling = WSJPEG_SAMPLING_420;
+            }
+            else if (i < argc && strcmp(argv[i], "422") == 0)
+            {
+                options.sampling = WSJPEG_SAMPLING_422;
+            }
+            else if (i < argc && strcmp(argv[i], "444") == 0)
+            {
+                options.sampling = WSJPEG_SAMPLING_444;
+            }
+            else if (i < argc && strcmp(argv[i], "gray") == 0)
+            {
+                options.sampling = WSJPEG_SAMPLING_GRAY;
+            }
+            else
+            {
+                usage_exit(argv[0], "The sampling should be \"420\", \"422\", \"444\" or \"gray\".");
+            }
+        }
+        else if (strcmp(argv[i], "--pipeline") == 0)
+        {
+            options.pipeline = 1;
+        }
+        else if (strcmp(argv[i], "--qualities") == 0)
+        {
+            count = parse_qualities(argv[0], argv[++i], qualities);
+        }
+        else if (strcmp(argv[i], "--target-size") == 0)
+        {
+            options.target_size = parse_number(argv[0], argv[++i], 1, INT_MAX,
+                                               "The target size should be a positive number of bytes.");
+        }
+        else if (strcmp(argv[i], "--stats") == 0)
+        {
+#ifdef USE_STATS
+            show_stats = 1;
+#else
+            usage_exit(argv[0], "Statistics need a build with -DUSE_STATS.");
+#endif
+        }
+        else if (strcmp(argv[i], "--color") == 0)
+        {
+            if (++i < argc && strcmp(argv[i], "float") == 0)
+            {
+                options.color_method = COLOR_FLOAT;
+            }
+            else if (i < argc && strcmp(argv[i], "int") == 0)
+            {
+                options.color_method = COLOR_INTEGER;
+            }
+            else
+            {
+                usage_exit(argv[0], "The color conversion should be \"float\" or \"int\".");
+            }
+        }
+        else if (strcmp(argv[i], "--simd") == 0)
+        {
+            if (++i >= argc || (options.simd = simd_parse(argv[i])) < 0)
+            {
+                usage_exit(argv[0], "The SIMD level should be \"auto\", \"none\", \"sse2\" or \"avx2\".");
+            }
+        }
+        else if (strcmp(argv[i], "--dct") == 0)
+        {
+            if (++i < argc && strcmp(argv[i], "float") == 0)
+            {
+                options.dct_method = DCT_FLOAT;
+            }
+            else if (i < argc && strcmp(argv[i], "int") == 0)
+            {
+                options.dct_method = DCT_INTEGER;
+            }
+            else
+            {
+                usage_exit(argv[0], "The DCT method should be \"float\" or \"int\".");
+            }
+        }
+        else if (argv[i][0] == '-' && argv[i][1] == '-')
+        {
+            usage_exit(argv[0], "Unknown option.");
+        }
+        else if (nargs < 3)
+        {
+            args[nargs++] = argv[i];
+        }
+        else
+        {
+            usage_exit(argv[0], "Too many arguments.");
+        }
+    }
+
+    /* settled once, every encoder of the run uses the same kernels */
+    if ((options.simd = simd_resolve(options.simd)) < 0)
+    {
+        usage_exit(argv[0], "The SIMD level is not supported by this build or processor.");
+    }
+
+    /* with a target size the quality is only the highest one tried */
+    if (options.target_size != 0)
+    {
+        options.quality = 100;
+    }
+
+    if (list != NULL)
+    {
+        /* the quality is the default of the jobs that do not give one */
+        if (count != 0)
+        {
+            usage_exit(argv[0], "The batch mode codes one quality per job.");
+        }
+        if (nargs > 1)
+        {
+            usage_exit(argv[0], "Too many arguments.");
+        }
+        else if (nargs > 0)
+        {
+            options.quality = parse_number(argv[0], args[0], 0, 100,
+                                           "The value of quality should be between 0 and 100.");
+        }
+        in_file = (strcmp(list, "-") == 0) ? stdin : fopen(list, "r");
+        if (in_file == NULL)
+        {
+            error_exit(LIST_OPEN_ERROR);
+        }
+        i = batch_run(in_file, &options, stream, show_stats ? &stats : NULL);
+        if (in_file != stdin)
+        {
+            fclose(in_file);
+        }
+        return (i == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    if (nargs < 2)
+    {
+        usage_exit(argv[0], NULL);
+    }
+    else if (count != 0)
+    {
+        if (nargs > 2 || options.target_size != 0)
+        {
+            usage_exit(argv[0], "With --qualities there is no quality argument and no target size.");
+        }
+        if (strstr(args[1], "%d") == NULL)
+        {
+            usage_exit(argv[0], "With --qualities the output name needs a %d for the quality.");
+        }
+        /* the %d becomes up to three digits, and a terminating zero follows */
+        if (strlen(args[1]) + 2 > FILENAME_MAX)
+        {
+            usage_exit(argv[0], "The output name is too long.");
+        }
+    }
+    else if (nargs > 2)
+    {
+        options.quality = parse_number(argv[0], args[2], 0, 100,
+                                       "The value of quality should be between 0 and 100.");
+    }
+
+    in_file = fopen(args[0], "rb");
+    if (in_file == NULL)
+    {
+        error_exit(BMP_OPEN_ERROR);
+    }
+
+    if (count != 0)
+    {
+        encode_qualities(in_file, args[1], qualities, count, &options, stream, show_stats ? &stats : NULL);
+        fclose(in_file);
+        return EXIT_SUCCESS;
+    }
+
+    out_file = fopen(args[1], "wb");
+    if (out_file == NULL)
+    {
+        error_exit(JPG_OPEN_ERROR);
+    }
+
+    encode_file(in_file, out_file, NULL, 0, &options, stream, show_stats ? &stats : NULL);
+
+    fclose(in_file);
+    if (fclose(out_file) != 0)
+    {
+        error_exit(JPG_WRITE_ERROR);
+    }
 
     return EXIT_SUCCESS;
 }
+#endif /* WSJPEG_NO_MAIN */
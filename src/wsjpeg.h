@@ -0,0 +1,186 @@
+/*
+ * Copyright (C) 2022 Wang Sheng
+ *
+ * This file is part of Wang Sheng's graduation project at
+ * Nanjing Institute of Technology.
+ *
+ * This file is under the GNU Lesser General Public License
+ * version 2.1 or later (LGPL v2.1+). You can redistribute it
+ * and/or modify it under the terms of the GNU Lesser General
+ * Public License as published by the Free Software Foundation;
+ * either version 2.1 of the License, or (at your option) any
+ * later version.
+ */
+
+#ifndef WSJPEG_H
+#define WSJPEG_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Library interface. Build wsjpeg.c with -DWSJPEG_NO_MAIN to
+ * leave out the command line program. No function exits the
+ * process, every failure is returned as one of the codes below.
+ * An encoder may only be used by one thread at a time, but any
+ * number of encoders can run at once.
+ */
+
+#define WSJPEG_OK                   0
+#define WSJPEG_ERROR_MEMORY         1   /* an allocation failed */
+#define WSJPEG_ERROR_ARGUMENT       2   /* invalid option or argument */
+#define WSJPEG_ERROR_BMP_INVALID    3   /* not a BMP file */
+#define WSJPEG_ERROR_BMP_CORRUPT    4   /* truncated or inconsistent BMP file */
+#define WSJPEG_ERROR_BMP_NOT_24BIT  5   /* BMP file is not 24-bit */
+#define WSJPEG_ERROR_TOO_LARGE      6   /* more than 65535 pixels wide or high */
+#define WSJPEG_ERROR_WRITE          7   /* the write callback failed */
+#define WSJPEG_ERROR_THREAD         8   /* a thread could not be created */
+#define WSJPEG_ERROR_UNSUPPORTED    9   /* not built into this library, or not run by the processor */
+
+#define WSJPEG_DCT_FLOAT            0   /* floating-point AAN */
+#define WSJPEG_DCT_INTEGER          1   /* 32-bit fixed-point LLM */
+
+#define WSJPEG_COLOR_FLOAT          0   /* floating-point color conversion */
+#define WSJPEG_COLOR_INTEGER        1   /* 16-bit fixed-point lookup tables, within 1 of the float one */
+
+#define WSJPEG_SIMD_AUTO            0   /* the widest the processor runs, or the one WSJPEG_SIMD names */
+#define WSJPEG_SIMD_NONE            1   /* plain C */
+#define WSJPEG_SIMD_SSE2            2   /* 128-bit x86 vectors */
+#define WSJPEG_SIMD_AVX2            3   /* 256-bit x86 vectors */
+
+#define WSJPEG_SAMPLING_420         0   /* chroma halved in both directions */
+#define WSJPEG_SAMPLING_422         1   /* chroma halved horizontally */
+#define WSJPEG_SAMPLING_444         2   /* chroma at full resolution */
+#define WSJPEG_SAMPLING_GRAY        3   /* luma only, a single component */
+
+typedef struct
+{
+    int             quality;            /* quality factor, 0 - 100 */
+    unsigned short  restart_interval;   /* MCUs per restart interval, 0 if disabled */
+    int             threads;            /* number of threads coding restart intervals */
+    int             dct_method;         /* WSJPEG_DCT_FLOAT or WSJPEG_DCT_INTEGER */
+    int             optimize_huffman;   /* nonzero to build Huffman tables for the image, two passes */
+    int             pipeline;           /* nonzero to spread the stages over the threads, no restart markers needed */
+    int             sampling;           /* WSJPEG_SAMPLING_420, _422, _444 or _GRAY */
+    size_t          target_size;        /* nonzero for the highest quality up to quality that fits, one thread */
+    int             color_method;       /* WSJPEG_COLOR_FLOAT or WSJPEG_COLOR_INTEGER */
+    int             simd;               /* WSJPEG_SIMD_*, the kernels of color conversion, DCT and quantization */
+} wsjpeg_options;
+
+#define WSJPEG_STAGE_READ           0   /* reading and staging the pixels */
+#define WSJPEG_STAGE_COLOR          1   /* color space conversion and chroma subsampling */
+#define WSJPEG_STAGE_DCT            2   /* forward DCT */
+#define WSJPEG_STAGE_QUANTIZE       3   /* quantization */
+#define WSJPEG_STAGE_HUFFMAN        4   /* Huffman coding, also counting symbols and replaying them */
+#define WSJPEG_STAGE_WRITE          5   /* handing the bytes to the write callback */
+#define WSJPEG_STAGE_COUNT          6
+
+/*
+ * Statistics of the last encoding. Stage times are summed over
+ * all threads, so with more than one thread they add up to more
+ * than seconds.
+ */
+typedef struct
+{
+    double          stage_seconds[WSJPEG_STAGE_COUNT];
+    double          seconds;            /* wall time of the whole encoding */
+    unsigned long   blocks;             /* 8x8 blocks coded */
+    unsigned long   zero_blocks;        /* blocks without any nonzero AC coefficient */
+    unsigned long   skipped_blocks;     /* blocks not transformed, flat or repeating the MCU before */
+    unsigned long   nonzero_coefs;      /* nonzero coefficients, DC included */
+    unsigned long   zrl_codes;          /* runs of 16 zeros coded */
+    unsigned long   eob_codes;          /* end of block codes */
+    unsigned long   stuffed_bytes;      /* zero bytes inserted after 0xFF */
+    unsigned long   reallocs;           /* times a buffer had to grow */
+    double          bits[3];            /* Huffman coded bits of Y, Cb and Cr, without stuffing */
+    double          bytes;              /* bytes handed to the write callback */
+} wsjpeg_stats;
+
+typedef struct
+{
+    void *(*malloc_fn)(void *opaque, size_t size);
+    void *(*realloc_fn)(void *opaque, void *ptr, size_t size);
+    void  (*free_fn)(void *opaque, void *ptr);
+    void *opaque;
+} wsjpeg_allocator;
+
+/*
+ * Receives the encoded bytes in order, usually one row of MCUs
+ * at a time. Returns nonzero to abort the encoding.
+ */
+typedef int (*wsjpeg_write_fn)(void *opaque, const void *data, size_t size);
+
+typedef struct wsjpeg_encoder wsjpeg_encoder;
+
+/* fills options with the defaults: quality 75, one thread, no restart markers, standard tables, 4:2:0, no target size */
+void wsjpeg_default_options(wsjpeg_options *options);
+
+/*
+ * options and allocator may be NULL for the defaults, allocator
+ * is copied. The SIMD level is settled here, once per encoder;
+ * WSJPEG_ERROR_UNSUPPORTED if it is not built in or the processor
+ * lacks it. Setting the WSJPEG_SIMD environment variable to
+ * "none", "sse2" or "avx2" forces a level on WSJPEG_SIMD_AUTO.
+ */
+int wsjpeg_encoder_create(wsjpeg_encoder **encoder, const wsjpeg_options *options,
+                          const wsjpeg_allocator *allocator);
+
+/* width * height pixels, both at least 1, R, G, B bytes each, rows from top to bottom stride bytes apart */
+int wsjpeg_encode_rgb(wsjpeg_encoder *encoder, const unsigned char *pixels,
+                      unsigned width, unsigned height, size_t stride,
+                      wsjpeg_write_fn write, void *opaque);
+
+/* a complete 24-bit BMP file held in memory */
+int wsjpeg_encode_bmp_memory(wsjpeg_encoder *encoder, const void *bmp, size_t size,
+                             wsjpeg_write_fn write, void *opaque);
+
+/* one of the files of the _multi functions */
+typedef struct
+{
+    int             quality;            /* 0 - 100, in place of the quality of the options */
+    wsjpeg_write_fn write;
+    void            *opaque;            /* passed to write */
+} wsjpeg_output;
+
+/*
+ * Like wsjpeg_encode_rgb and wsjpeg_encode_bmp_memory, but codes
+ * a file for each of count outputs, all from one read and one
+ * DCT of the image. The DCT of the whole image is kept in memory,
+ * 256 bytes per 8x8 block. With more than one thread the outputs
+ * are coded at the same time, every write callback from the thread
+ * coding its output. Not with a target size.
+ */
+int wsjpeg_encode_rgb_multi(wsjpeg_encoder *encoder, const unsigned char *pixels,
+                            unsigned width, unsigned height, size_t stride,
+                            const wsjpeg_output *outputs, int count);
+
+int wsjpeg_encode_bmp_memory_multi(wsjpeg_encoder *encoder, const void *bmp, size_t size,
+                                   const wsjpeg_output *outputs, int count);
+
+/*
+ * Most bytes an image of width * height pixels can take when it
+ * is encoded with options (NULL for the defaults), so a buffer
+ * of this size, filled by the write callback, never overflows.
+ * 0 if the size or the options are not valid, (size_t) -1 if it
+ * does not fit.
+ */
+size_t wsjpeg_max_output_size(const wsjpeg_options *options, unsigned width, unsigned height);
+
+/*
+ * Statistics of the last encoding of encoder, also after an error.
+ * WSJPEG_ERROR_UNSUPPORTED unless wsjpeg.c is built with -DUSE_STATS.
+ */
+int wsjpeg_encoder_stats(const wsjpeg_encoder *encoder, wsjpeg_stats *stats);
+
+void wsjpeg_encoder_destroy(wsjpeg_encoder *encoder);
+
+const char *wsjpeg_error_string(int error);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* WSJPEG_H */
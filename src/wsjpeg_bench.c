@@ -0,0 +1,335 @@
+/*
+ * Copyright (C) 2022 Wang Sheng
+ *
+ * This file is part of Wang Sheng's graduation project at
+ * Nanjing Institute of Technology.
+ *
+ * This file is under the GNU Lesser General Public License
+ * version 2.1 or later (LGPL v2.1+). You can redistribute it
+ * and/or modify it under the terms of the GNU Lesser General
+ * Public License as published by the Free Software Foundation;
+ * either version 2.1 of the License, or (at your option) any
+ * later version.
+ */
+
+/*
+ * Stage benchmark. Encodes synthetic images with the encoder
+ * itself, in memory, and prints the time of every stage as
+ * the statistics of -DUSE_STATS count it, one CSV line (or
+ * JSON object) per image. Build it like wsjpeg.c, with the same
+ * options, it includes the encoder:
+ *
+ *     cc -O3 wsjpeg_bench.c -o wsjpeg_bench -lm
+ */
+
+#ifndef USE_STATS
+#define USE_STATS
+#endif
+#define WSJPEG_NO_MAIN
+#include "wsjpeg.c"
+#include <math.h>
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/resource.h>
+#endif
+
+#define PATTERN_FLAT            0
+#define PATTERN_GRADIENT        1
+#define PATTERN_NOISE           2
+#define PATTERN_PHOTO           3
+#define PATTERN_EDGES           4
+#define PATTERN_COUNT           5
+
+#define BENCH_MIN_SECONDS       0.25    /* small images are encoded again until this much time is spent */
+
+const char *PATTERN_NAMES[PATTERN_COUNT] = {"flat", "gradient", "noise", "photo", "edges"};
+
+const char *SAMPLING_NAMES[4] = {"420", "422", "444", "gray"};
+
+int bench_sink(void *opaque, const void *data, size_t size)
+{
+    (void) data;
+    *(SIZE_T *) opaque += size;
+    return 0;
+}
+
+BYTE bench_clamp(double value)
+{
+    return (BYTE) (value < 0 ? 0 : value > 255 ? 255 : value + 0.5);
+}
+
+void bench_pixel(int pattern, UINT32 x, UINT32 y, UINT32 width, UINT32 height, UINT32 *seed, BYTE bgr[3])
+{
+    /* deterministic test images, the noise depends on the seed */
+    double u = (double) x / width, v = (double) y / height, base;
+    int c;
+
+    switch (pattern)
+    {
+    case PATTERN_FLAT:
+        bgr[0] = 96;
+        bgr[1] = 128;
+        bgr[2] = 160;
+        break;
+    case PATTERN_GRADIENT:
+        bgr[0] = bench_clamp(255 * (u + v) / 2);
+        bgr[1] = bench_clamp(255 * v);
+        bgr[2] = bench_clamp(255 * u);
+        break;
+    case PATTERN_NOISE:
+        for (c = 0; c < 3; c++)
+        {
+            *seed = *seed * 1103515245UL + 12345;
+            bgr[c] = (BYTE) (*seed >> 16);
+        }
+        break;
+    case PATTERN_PHOTO:
+        /* smooth shapes at a few scales with a little sensor noise */
+        *seed = *seed * 1103515245UL + 12345;
+        base = 110 + 60 * sin(x / 41.0 + 2 * v) * cos(y / 29.0) + 25 * sin((x + 2.0 * y) / 7.0) +
+               ((*seed >> 16) & 15) - 7.5;
+        bgr[0] = bench_clamp(base * 0.8 + 40 * v);
+        bgr[1] = bench_clamp(base);
+        bgr[2] = bench_clamp(base * 1.1 + 30 * u);
+        break;
+    default:
+        /* hard edges in all directions */
+        c = (((x / 13) ^ (y / 9)) & 1) ^ ((x + y) / 31 & 1) ^ ((x > y) ? 1 : 0);
+        bgr[0] = c ? 250 : 10;
+        bgr[1] = c ? 240 : 30;
+        bgr[2] = c ? 20 : 220;
+        break;
+    }
+}
+
+BYTE *bench_image(pCONTEXT context, int pattern, UINT32 size)
+{
+    /* size x size RGB pixels, top to bottom */
+    BYTE *pixels, bgr[3];
+    UINT32 seed = 1, x, y;
+
+    pixels = mem_alloc(context, (SIZE_T) size * size * 3);
+    for (y = 0; y < size; y++)
+    {
+        for (x = 0; x < size; x++)
+        {
+            bench_pixel(pattern, x, y, size, size, &seed, bgr);
+            pixels[((SIZE_T) y * size + x) * 3 + 0] = bgr[2];
+            pixels[((SIZE_T) y * size + x) * 3 + 1] = bgr[1];
+            pixels[((SIZE_T) y * size + x) * 3 + 2] = bgr[0];
+        }
+    }
+    return pixels;
+}
+
+long bench_peak_rss(void)
+{
+    /*
+     * Peak resident set of the whole process in KiB, 0 if
+     * unknown. It never goes down, so it only describes an
+     * image if no larger one was encoded before it.
+     */
+#if defined(__unix__) || defined(__APPLE__)
+    struct rusage usage;
+
+    if (getrusage(RUSAGE_SELF, &usage) == 0)
+    {
+#ifdef __APPLE__
+        return usage.ru_maxrss / 1024;
+#else
+        return usage.ru_maxrss;
+#endif
+    }
+#endif
+    return 0;
+}
+
+void bench_print(pOPTIONS options, int pattern, UINT32 size, int json, const STATS *stats, int passes, SIZE_T written)
+{
+    const char *format;
+    double ms[WSJPEG_STAGE_COUNT], seconds, pixels;
+    int i;
+
+    for (i = 0; i < WSJPEG_STAGE_COUNT; i++)
+    {
+        ms[i] = stats->stage_seconds[i] * 1000 / passes;
+    }
+    seconds = stats->seconds / passes;
+    pixels = (double) size * size;
+    if (json)
+    {
+        format = "{\"pattern\": \"%s\", \"width\": %lu, \"height\": %lu, \"quality\": %d, \"sampling\": \"%s\", "
+                 "\"dct\": \"%s\", \"color\": \"%s\", \"simd\": \"%s\", "
+                 "\"read_ms\": %.3f, \"color_ms\": %.3f, \"dct_ms\": %.3f, \"quant_ms\": %.3f, \"huffman_ms\": %.3f, "
+                 "\"write_ms\": %.3f, \"total_ms\": %.3f, \"mpix_per_s\": %.2f, \"ns_per_block\": %.1f, "
+                 "\"bytes_per_pixel\": %.4f, \"process_peak_rss_kb\": %ld}\n";
+    }
+    else
+    {
+        format = "%s,%lu,%lu,%d,%s,%s,%s,%s,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%.2f,%.1f,%.4f,%ld\n";
+    }
+    printf(format, PATTERN_NAMES[pattern], (unsigned long) size, (unsigned long) size, options->quality,
+           SAMPLING_NAMES[options->sampling], options->dct_method == DCT_INTEGER ? "int" : "float",
+           options->color_method == COLOR_INTEGER ? "int" : "float", SIMD_NAMES[options->simd],
+           ms[WSJPEG_STAGE_READ], ms[WSJPEG_STAGE_COLOR], ms[WSJPEG_STAGE_DCT], ms[WSJPEG_STAGE_QUANTIZE],
+           ms[WSJPEG_STAGE_HUFFMAN], ms[WSJPEG_STAGE_WRITE], seconds * 1000, pixels / seconds / 1e6,
+           seconds * 1e9 / (stats->blocks / passes), (double) written / pixels, bench_peak_rss());
+    fflush(stdout);
+}
+
+void bench_encode(pCONTEXT context, pOPTIONS options, int pattern, UINT32 size, int json)
+{
+    STATS stats, total;
+    pBITMAP bitmap;
+    pJPEG jpeg;
+    SIZE_T written = 0;
+    int passes = 0;
+
+    bitmap = bitmap_open_rgb(context, bench_image(context, pattern, size), size, size, (SIZE_T) size * 3);
+    jpeg = jpeg_create(context, options);
+    memset(&total, 0, sizeof(total));
+    do
+    {
+        written = 0;
+        memset(&stats, 0, sizeof(stats));
+        jpeg_encode_bmp(jpeg, bitmap, options, bench_sink, &written, &stats);
+        stats_add(&total, &stats);
+        total.seconds += stats.seconds;
+        passes++;
+    } while (total.seconds < BENCH_MIN_SECONDS);
+
+    bench_print(options, pattern, size, json, &total, passes, written);
+}
+
+void bench_run(pOPTIONS options, int pattern, UINT32 size, int json)
+{
+    CONTEXT context;
+
+    context_init(&context, NULL);
+    if (setjmp(context.jump) == 0)
+    {
+        bench_encode(&context, options, pattern, size, json);
+    }
+    else
+    {
+        fprintf(stderr, "%s\n", wsjpeg_error_string(context.error));
+    }
+    mem_free_all(&context);
+}
+
+void usage_exit(char *program)
+{
+    fprintf(stderr, "Usage: %s [--json] [--quality Q] [--sampling 420|422|444|gray]\n"
+                    "           [--dct float|int] [--color float|int] [--simd LEVEL]\n"
+                    "           [--pattern NAME] [SIZE ...]\n\n"
+                    "  Encodes SIZE x SIZE synthetic images (default 64 256 1024 4096) of every\n"
+                    "  pattern (flat, gradient, noise, photo, edges) and prints the time of each\n"
+                    "  stage per image, as CSV or one JSON object per line. LEVEL is auto\n"
+                    "  (default), none, sse2 or avx2, the kernels to time.\n",
+                    program);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+    OPTIONS options;
+    UINT32 sizes[32] = {64, 256, 1024, 4096};
+    int nsizes = 0, json = 0, pattern = -1;
+    int i, p;
+    long value;
+
+    wsjpeg_default_options(&options);
+    for (i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--json") == 0)
+        {
+            json = 1;
+        }
+        else if (strcmp(argv[i], "--quality") == 0 && i + 1 < argc)
+        {
+            options.quality = atoi(argv[++i]);
+            if (options.quality < 0 || options.quality > 100)
+            {
+                usage_exit(argv[0]);
+            }
+        }
+        else if (strcmp(argv[i], "--sampling") == 0 && i + 1 < argc)
+        {
+            for (i++, options.sampling = 0; options.sampling < 4; options.sampling++)
+            {
+                if (strcmp(argv[i], SAMPLING_NAMES[options.sampling]) == 0)
+                {
+                    break;
+                }
+            }
+            if (options.sampling == 4)
+            {
+                usage_exit(argv[0]);
+            }
+        }
+        else if (strcmp(argv[i], "--dct") == 0 && i + 1 < argc)
+        {
+            i++;
+            options.dct_method = (strcmp(argv[i], "int") == 0) ? DCT_INTEGER : DCT_FLOAT;
+        }
+        else if (strcmp(argv[i], "--color") == 0 && i + 1 < argc)
+        {
+            i++;
+            options.color_method = (strcmp(argv[i], "int") == 0) ? COLOR_INTEGER : COLOR_FLOAT;
+        }
+        else if (strcmp(argv[i], "--simd") == 0 && i + 1 < argc)
+        {
+            if ((options.simd = simd_parse(argv[++i])) < 0)
+            {
+                usage_exit(argv[0]);
+            }
+        }
+        else if (strcmp(argv[i], "--pattern") == 0 && i + 1 < argc)
+        {
+            for (i++, pattern = 0; pattern < PATTERN_COUNT; pattern++)
+            {
+                if (strcmp(argv[i], PATTERN_NAMES[pattern]) == 0)
+                {
+                    break;
+                }
+            }
+            if (pattern == PATTERN_COUNT)
+            {
+                usage_exit(argv[0]);
+            }
+        }
+        else if ((value = atol(argv[i])) > 0 && value <= 65535 && nsizes < 32)
+        {
+            sizes[nsizes++] = (UINT32) value;
+        }
+        else
+        {
+            usage_exit(argv[0]);
+        }
+    }
+    if (nsizes == 0)
+    {
+        nsizes = 4;
+    }
+
+    if ((options.simd = simd_resolve(options.simd)) < 0)
+    {
+        fprintf(stderr, "%s\n", wsjpeg_error_string(WSJPEG_ERROR_UNSUPPORTED));
+        return EXIT_FAILURE;
+    }
+    if (!json)
+    {
+        printf("pattern,width,height,quality,sampling,dct,color,simd,read_ms,color_ms,dct_ms,quant_ms,huffman_ms,"
+               "write_ms,total_ms,mpix_per_s,ns_per_block,bytes_per_pixel,process_peak_rss_kb\n");
+    }
+    for (i = 0; i < nsizes; i++)
+    {
+        for (p = 0; p < PATTERN_COUNT; p++)
+        {
+            if (pattern < 0 || pattern == p)
+            {
+                bench_run(&options, p, sizes[i], json);
+            }
+        }
+    }
+    return EXIT_SUCCESS;
+}